@@ -5,17 +5,15 @@
  * for details.
  */
 
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <avr/pgmspace.h>
-#include <avr/sleep.h>
-#include <avr/eeprom.h>
+#include <stddef.h>
+#include "hal.h"
 #include "common.h"
 #include "timer.h"
 #include "util.h"
 #include "blind.h"
 #include "button.h"
 #include "ir.h"
+#include "eewrite.h"
 
 /*
  * two different state machines drive the window blind.
@@ -57,7 +55,43 @@ enum {
     // MOTOR_REVERSE,
 };
 static char motor_cur, motor_next;
-long motor_state_timer;
+
+// settling delays between motor transitions, and the failsafes
+static struct sw_timer motor_timer;
+static struct sw_timer runtime_timer;
+static struct sw_timer stall_timer;
+
+/*
+ * stall detection.  the rotation interrupt handler keeps a running
+ * estimate of the time between pulses.  if the motor is on, and a
+ * pulse is several intervals late, then the spool is jammed or the
+ * cord has broken, and we stop.  the estimate starts out long when
+ * the motor is started, and follows the intervals down as it comes
+ * up to speed.
+ */
+#define STALL_START_IVAL 300    // ms, assumed until the first pulse
+#define STALL_FACTOR     3      // how many intervals late is a stall
+#define STALL_CHECK      20     // ms between checks
+
+static volatile unsigned int pulse_ival;    // estimated ms per pulse
+static volatile unsigned int last_pulse;    // when the last one came
+static volatile unsigned int last_ival;     // and how long before that
+
+/*
+ * the rotation pulse comes over a long cable, alongside the motor
+ * wires, and relay switching can put extra edges on it.  pulses
+ * closer together than the spool can turn, or that come when the
+ * motor has been off for too long for the spool to be coasting,
+ * aren't counted.  they're counted here instead.  this is timed
+ * from the last pulse we counted, not from last_pulse, which the
+ * stall check moves to the motor's start.  the slow approach turns
+ * the power off on purpose, so that's not "off" here.
+ */
+#define PULSE_MIN_IVAL  50      // ms.  full speed is 125.
+#define PULSE_IDLE      2000    // ms after the last pulse, with power off
+
+static volatile unsigned long last_counted;    // all 32 bits
+static volatile word pulses_fast, pulses_idle;
 
 char blind_state_debug;
 char blind_motor_debug;
@@ -76,6 +110,7 @@ enum {
     BLIND_FORCE_UP,
     BLIND_FORCE_DOWN,
     BLIND_TOGGLE,
+    BLIND_BACKOFF,
     BLIND_NOP,
 };
 static char blind_do;
@@ -96,9 +131,16 @@ static int ignore_limit;
 
 // we want to save our more recent position in non-volatile memory,
 // so that we still know where the blind is after a power failure.
-// we do the save 30 seconds after the last movement stopped.
-static long config_change_timer;
-static char config_changed;
+// we do the save 30 seconds after the last movement stopped.  with
+// warning of power failures (see below), the position is saved
+// then, and this is just a backstop, so we wait longer.
+#ifdef POWER_FAIL
+#define CONFIG_SAVE_DELAY   60000U  // (the longest sw_timer)
+#else
+#define CONFIG_SAVE_DELAY   30000U
+#endif
+static struct sw_timer config_timer;
+static volatile char config_changed;
 
 // our desired position
 static int goal;
@@ -116,8 +158,188 @@ struct blind_config {
     int position;
     int up_dir;
     int magic2;
+    // added later, so an older config has junk here.  we check.
+    int coast_up;       // learned coast distances (see below)
+    int coast_down;
+    int slow_up;        // slow approach distances (see below)
+    int slow_down;
+    int limit_pos;      // where the limit switch is (see below)
+    int limit_chk;      // ~limit_pos, if it's known
 } blc[1];
 
+/*
+ * the spool keeps turning for a while after we stop the motor, so
+ * we issue the stop early, by the distance it coasted the last few
+ * times it went the same way.  after each stop at a goal, we wait
+ * for the spool to come to rest, and measure.  the learned
+ * distances are kept in 1/16ths of a pulse.
+ */
+#define COAST_SCALE     16
+#define COAST_DEFAULT   COAST_SCALE             // one pulse
+#define COAST_MAX       (8 * COAST_SCALE)
+#define COAST_SETTLE    1500    // ms for the spool to come to rest
+// shorter moves never get up to speed, and coast less
+#define COAST_MIN_MOVE  inch_to_pulse(3)
+
+#define coast_pulses(c) (((c) + COAST_SCALE / 2) / COAST_SCALE)
+
+static struct sw_timer coast_timer;
+static char coast_dir;      // BLIND_IS_RISING or _FALLING, while measuring
+static int coast_from;      // where the stop was issued
+static word coast_count;    // rotation count when the stop was issued
+static int move_from;       // where the move started
+static int coast_error_up, coast_error_down;  // last arrival error
+
+// every rotation pulse, whichever way the spool is turning
+static volatile word rotations;
+
+// which way the spool is turning:  the direction relay's setting
+// when the motor was last started.  the relay itself is reversed
+// to brake the motor, while the spool is still coasting, so the
+// rotation interrupt handler can't just read it.  the motor is
+// only started once the spool has come to rest, so that's when
+// this changes.
+static volatile char travel_dir;
+
+/*
+ * the stop at a goal is made by the rotation interrupt handler, at
+ * the pulse that reaches it.  if the main loop made it, the stop
+ * would come however late the current pass finishes -- a long
+ * printout or an eeprom write means a longer overshoot.  the state
+ * machines see that the motor was stopped on their next pass.
+ */
+static volatile char armed_dir;     // BLIND_IS_RISING or _FALLING, or 0
+static volatile char armed_hit;     // the handler made the stop
+static int armed_stop;              // the position to stop at
+
+/*
+ * the slow approach.  the last few pulses before the stop are made
+ * with the motor switched on and off, so that the spool arrives
+ * more slowly, and coasts less, and less variably.  there's no
+ * hardware pwm on the motor pin, and the motor couldn't use a fast
+ * one anyway (it's switched by a relay, or a slow fet), so the
+ * duty cycle is a slow one, done with a software timer.  the
+ * distances, in pulses, are set per direction, with the monitor's
+ * 'a' command.  zero turns it off.
+ */
+#define SLOW_ON     40      // ms of power
+#define SLOW_OFF    60      // ms of coasting
+#define SLOW_MAX    20      // pulses
+#define SLOW_STALL  2000    // ms without a pulse, while approaching
+
+static struct sw_timer slow_timer;
+static volatile char slow_active;
+
+#ifdef MOVE_TRACE
+/*
+ * a trace of the most recent move, for tuning the motor timings.
+ * the rotation interrupt handler records every pulse, and the
+ * motor state machine records its transitions, each as the time
+ * since the previous entry.  MOVE_TRACE is the size of the buffer,
+ * in bytes.  a move takes about a byte per pulse, plus a few for
+ * the transitions.  if it fills, the oldest entries are dropped.
+ *
+ *   0x00-0xef  a pulse, this many ms after the previous entry
+ *   0xf0-0xf7  the motor state (low bits) changed.  the next byte
+ *              is the ms since the previous entry.
+ *   0xfe       200 ms passed
+ */
+#if MOVE_TRACE > 255
+#error MOVE_TRACE is too big
+#endif
+#define TR_MAX_MS   0xef
+#define TR_MARK     0xf0
+#define TR_GAP      0xfe
+#define TR_GAP_MS   200
+#define TR_SLOW     6       // the slow approach began
+#define TR_GOAL     7       // the interrupt handler stopped at the goal
+
+static unsigned char trace[MOVE_TRACE];
+static unsigned char trace_head, trace_tail;
+static unsigned int trace_last;     // time of the newest entry
+
+// call with interrupts off
+static void trace_byte(unsigned char b)
+{
+    unsigned char next = (trace_head + 1) % MOVE_TRACE;
+
+    if (next == trace_tail) {   // full.  drop the oldest entry.
+        if (trace[trace_tail] >= TR_MARK && trace[trace_tail] != TR_GAP)
+            trace_tail = (trace_tail + 1) % MOVE_TRACE;
+        trace_tail = (trace_tail + 1) % MOVE_TRACE;
+    }
+    trace[trace_head] = b;
+    trace_head = next;
+}
+
+// call with interrupts off.  mark is 0 for a pulse.
+static void trace_entry(unsigned char mark, unsigned int now)
+{
+    unsigned int ms = now - trace_last;
+
+    trace_last = now;
+    while (ms > TR_MAX_MS) {
+        trace_byte(TR_GAP);
+        ms -= TR_GAP_MS;
+    }
+    if (mark)
+        trace_byte(mark);
+    trace_byte(ms);
+}
+
+// the motor state machine has changed state.  a start begins a new trace.
+static void trace_motor(char state)
+{
+    unsigned int now = get_ms_timer();
+
+    cli();
+    if (state == MOTOR_UP || state == MOTOR_DOWN) {
+        trace_head = trace_tail = 0;
+        trace_last = now;
+    }
+    trace_entry(TR_MARK | state, now);
+    sei();
+}
+
+/* monitor support:  show the trace.  times are in ms, from the
+ * first entry.  pulses also show the time since the last pulse. */
+void blind_show_trace(void)
+{
+    unsigned char i, head, b;
+    unsigned int t = 0, t_pulse = 0;
+
+    cli();
+    i = trace_tail;
+    head = trace_head;
+    sei();
+
+    while (i != head) {
+        b = trace[i];
+        i = (i + 1) % MOVE_TRACE;
+        if (b == TR_GAP) {
+            t += TR_GAP_MS;
+            continue;
+        }
+        if (b >= TR_MARK) {
+            t += trace[i];
+            i = (i + 1) % MOVE_TRACE;
+            putdec16(t);
+            putstr("\tstate ");
+            putdec16(b & ~TR_MARK);
+        } else {
+            t += b;
+            putdec16(t);
+            putch('\t');
+            putdec16(t - t_pulse);
+            t_pulse = t;
+        }
+        crnl();
+    }
+}
+#else
+#define trace_motor(state)
+#endif
+
 /*
  * convert spool revolutions to (roughly) inches of travel of the
  * blind:
@@ -209,27 +431,315 @@ void dump_config(void)
     }
 }
 
-/* request a timed config save */
+/*
+ * the position changes with nearly every move, so it isn't saved
+ * in the config header at address 0 (the field there is only used
+ * if the journal is empty).  instead, it's appended to a circular
+ * journal of small records in most of the rest of the eeprom,
+ * spreading the wear across all of it.  each record carries a sequence
+ * number, and a crc so that a write interrupted by a power failure
+ * is ignored.  the crc starts from a seed chosen so that neither a
+ * zeroed slot nor an erased one looks good.  at boot, the newest good
+ * record wins.
+ */
+#define JOURNAL_START   64      // the config header lives below here
+#define JOURNAL_END     IR_LEARN_EEPROM  // learned IR codes above
+
+struct pos_record {
+    word position;
+    byte seq;
+    byte crc;
+};
+
+#define JOURNAL_SLOTS \
+    ((JOURNAL_END - JOURNAL_START) / sizeof(struct pos_record))
+#define journal_addr(slot) \
+    (JOURNAL_START + (slot) * sizeof(struct pos_record))
+#define JOURNAL_CRC_SEED 0x5a   // zeroes give crc 0x11, 0xff's give 0x77
+
+static byte journal_slot;       // where the newest record is
+static byte journal_seq;
+static int journal_pos;         // what it says
+
+// what's being written.  saves are queued, and written in the
+// background, from these copies.  a power failure can write a
+// journal record while the last one is still queued, so there are
+// two of those.
+static struct blind_config blc_saved[1];
+static struct pos_record journal_rec[2];
+
+static byte pos_record_crc(struct pos_record *r)
+{
+    byte crc, *p;
+
+    crc = JOURNAL_CRC_SEED;
+    for (p = (byte *)r; p < &r->crc; p++)
+        crc = _crc_ibutton_update(crc, *p);
+    return crc;
+}
+
+// find the newest record.  there are fewer slots than half the
+// sequence numbers, so every good record is within 127 of it.
+static char journal_read(void)
+{
+    struct pos_record r;
+    byte slot;
+    char found = 0;
+
+    for (slot = 0; slot < JOURNAL_SLOTS; slot++) {
+        eeprom_read_block(&r, (void *)journal_addr(slot), sizeof(r));
+        if (r.crc != pos_record_crc(&r))
+            continue;
+        if (!found || (signed char)(r.seq - journal_seq) > 0) {
+            journal_slot = slot;
+            journal_seq = r.seq;
+            journal_pos = r.position;
+            found = 1;
+        }
+    }
+    return found;
+}
+
+// call with interrupts off.  a power failure's record is urgent.
+// returns 0, and leaves the journal as it was, if the write
+// couldn't be queued.
+static char journal_write(int pos, char urgent)
+{
+    struct pos_record *r;
+    byte slot, seq;
+    char ok;
+
+    slot = (journal_slot + 1) % JOURNAL_SLOTS;
+    seq = journal_seq + 1;
+
+    r = &journal_rec[seq & 1];
+    r->position = pos;
+    r->seq = seq;
+    r->crc = pos_record_crc(r);
+    if (urgent)
+        ok = ee_write_urgent(r, journal_addr(slot), sizeof(*r));
+    else
+        ok = ee_write(r, journal_addr(slot), sizeof(*r));
+    if (!ok)
+        return 0;
+
+    journal_slot = slot;
+    journal_seq = seq;
+    journal_pos = pos;
+    return 1;
+}
+
+/* request a timed config save.  may be called from interrupt context. */
 void blind_save_config(void)
 {
-    config_change_timer = get_ms_timer();
     config_changed = 1;
 }
 
 /* really save the config */
 void blind_save_config_real(void)
 {
+    // the last save is still being written.  try again later.
+    if (ee_busy()) {
+        blind_save_config();
+        return;
+    }
+
     print_tstamp();
     putstr("saving config\n");
-    eeprom_update_block(blc, (void *)0, sizeof(*blc));
+
+    // the position changes at interrupt time, so take a copy of
+    // everything at once
+    cli();
+    *blc_saved = *blc;
+    if (blc_saved->position != journal_pos &&
+            !journal_write(blc_saved->position, 0)) {
+        sei();
+        blind_save_config();
+        return;
+    }
+    sei();
+
+    // everything else goes in the header, which rarely changes
+    ee_write(blc_saved, 0, offsetof(struct blind_config, position));
+    ee_write(&blc_saved->up_dir, offsetof(struct blind_config, up_dir),
+            sizeof(*blc) - offsetof(struct blind_config, up_dir));
     dump_config();
 }
 
+#ifdef POWER_FAIL
+/*
+ * early warning of a power failure.  a divider from the motor's
+ * 12V supply (68K over 10K) feeds PA7 (ADC6), and the analog
+ * comparator compares it with the 1.1V bandgap.  it trips when the
+ * 12V falls below about 8.6V, before the 5V regulator drops out.
+ * we then have the holdup time of the decoupling caps to write
+ * the position to the journal:  4 bytes, or 14ms at most, plus the
+ * end of a byte that was already being written (see eewrite.c).  the
+ * brown-out detector should be enabled ("make bod_fuse"), so that
+ * as the 5V finally goes, the chip is held in reset, rather than
+ * running, and writing, at too low a voltage.
+ */
+#define POWER_MUX       6       // ADC6
+
+static volatile char power_failed;  // 1 when detected, 2 when handled
+
+static void power_fail_init(void)
+{
+    DIDR0 |= bit(ADC6D);    // it's analog only
+    ADMUX = POWER_MUX;
+    // the bandgap against the ADC multiplexer, interrupting when
+    // the output rises, i.e., when the sensed voltage falls
+    ACSRA = bit(ACBG) | bit(ACME) | bit(ACIS1) | bit(ACIS0);
+    usec_delay(100);        // let the bandgap settle
+    ACSRA |= bit(ACI);
+    ACSRA |= bit(ACIE);
+}
+
+ISR(ANA_COMP_vect)      // the supply is failing
+{
+    ISR_PROF_ENTER();
+
+    int pos = blc->position;
+
+    // drop the motor, our biggest load, and save the position.  if
+    // it was running, we won't be around to count the coast.
+    if (PINMOTOR & bit(P_MOTOR_ON)) {
+        PORTMOTOR &= ~bit(P_MOTOR_ON);
+        if (blind_is == BLIND_IS_RISING)
+            pos += coast_pulses(blc->coast_up);
+        else if (blind_is == BLIND_IS_FALLING)
+            pos -= coast_pulses(blc->coast_down);
+    }
+    armed_dir = 0;
+    if (pos != journal_pos)
+        journal_write(pos, 1);
+
+    ACSRA &= ~bit(ACIE);
+    power_failed = 1;
+    post_event(EV_BLIND);
+
+    ISR_PROF_EXIT(ISRP_ANA_COMP);
+}
+#else
+#define power_fail_init()
+#endif
+
+/*
+ * the limit switch is wired to the RESET pin, so reaching it
+ * reboots us, and we come up knowing exactly where we are.  the
+ * first such reset records the position as the switch's location.
+ * after that, each one puts the position back there, and reports
+ * how far the count had drifted.  then we back away from the
+ * switch.
+ *
+ * the journal's position may be from before the move began, so the
+ * rotation interrupt handler also keeps the count in memory that
+ * the reset doesn't clear, with its complement as a check.
+ *
+ * but the RESET pin also fires for the programmer, or a hand on
+ * the reset button.  so it only counts as the switch if nothing
+ * else caused the reset, and the motor was driving us toward it
+ * (whichever end it's at) at the time.  that's remembered across
+ * the reset, too.
+ */
+#define LIMIT_BACKOFF   inch_to_pulse(2)
+
+static int reset_pos NOINIT;
+static int reset_chk NOINIT;
+static char driving NOINIT;
+static char driving_chk NOINIT;
+static int limit_drift;
+
+/*
+ * drift measurement.  the limit switch doesn't move, so the position
+ * counted when we reach it should always be the same.  while this
+ * is on, "bottom" goes all the way down to the limit, and each
+ * visit reports how far off the count was.  each visit also puts
+ * the position right again, so that's only this trip's error:  the
+ * total, and the worst one, are kept across visits, so a steady
+ * miscount shows up.  each visit resets us, so the measurements
+ * live through resets too, with a check word in case they're
+ * garbage.
+ */
+static struct {
+    char on;
+    byte visits;
+    int total;
+    int worst;          // size of the biggest error
+    int chk;
+} drift NOINIT;
+
+static int drift_sum(void)
+{
+    return ~(drift.on ^ drift.visits ^ drift.total ^ drift.worst);
+}
+
+static void drift_visit(int err)
+{
+    drift.visits++;
+    drift.total += err;
+    if (err > drift.worst || -err > drift.worst)
+        drift.worst = err < 0 ? -err : err;
+    drift.chk = drift_sum();
+
+    print_tstamp();
+    putstr("limit\n");
+    p_dec(err);
+    p_dec(drift.total);
+    crnl();
+}
+
+static void set_driving(char on)
+{
+    driving = on;
+    driving_chk = ~on;
+}
+
+static char limit_was_hit(void)
+{
+    if ((saved_mcusr & (bit(EXTRF) | bit(PORF) | bit(BORF) | bit(WDRF)))
+            != bit(EXTRF))
+        return 0;
+    return driving_chk == (char)~driving && driving;
+}
+
+static void limit_reset(void)
+{
+    int pos = blc->position;
+
+    if (reset_chk == ~reset_pos)
+        pos = reset_pos;
+
+    print_tstamp();
+    if (blc->limit_chk == ~blc->limit_pos) {
+        limit_drift = pos - blc->limit_pos;
+        putstr("limit reset\n");
+        p_dec(limit_drift);
+        crnl();
+        if (drift.on)
+            drift_visit(limit_drift);
+    } else {
+        blc->limit_pos = pos;
+        blc->limit_chk = ~pos;
+        putstr("limit found\n");
+        p_hex(pos);
+        crnl();
+    }
+    blc->position = blc->limit_pos;
+    blind_do = BLIND_BACKOFF;
+}
+
 void blind_read_config(void)
 {
+    char changed = 0;
 
     eeprom_read_block(blc, 0, sizeof(*blc));
 
+    if (journal_read())
+        blc->position = journal_pos;
+    else
+        journal_pos = blc->position + 1;    // force a first record
+
     dump_config();
 
     // set sensible defaults
@@ -241,11 +751,43 @@ void blind_read_config(void)
         blc->up_dir = 0;
         blc->magic = 0xdead;
         blc->magic2 = 0xcafe;
-    
-        // write back any updated values
-        blind_save_config_real();
+        blc->limit_chk = ~blc->limit_pos + 1;   // not known
+        blc->coast_up = -1;     // fixed below
+        changed = 1;
     }
 
+    if (blc->coast_up < 0 || blc->coast_up > COAST_MAX ||
+        blc->coast_down < 0 || blc->coast_down > COAST_MAX) {
+        blc->coast_up = COAST_DEFAULT;
+        blc->coast_down = COAST_DEFAULT;
+        changed = 1;
+    }
+
+    if (blc->slow_up < 0 || blc->slow_up > SLOW_MAX ||
+        blc->slow_down < 0 || blc->slow_down > SLOW_MAX) {
+        blc->slow_up = 0;
+        blc->slow_down = 0;
+        changed = 1;
+    }
+
+    if (drift.chk != drift_sum()) {
+        drift.on = 0;
+        drift.visits = 0;
+        drift.chk = drift_sum();
+    }
+    if (limit_was_hit()) {
+        limit_reset();
+        changed = 1;
+    }
+    set_driving(0);
+    reset_pos = blc->position;
+    reset_chk = ~reset_pos;
+
+    // write back any updated values
+    if (changed)
+        blind_save_config_real();
+
+    power_fail_init();
 }
 
 /* initilization */
@@ -256,6 +798,10 @@ void blind_init(void)
 
     PORTMOTOR |= bit(P_LIMIT); // enable pullup
 
+    // the spool may still be coasting from before a reset.  take
+    // its pulses as if the last came just before we started.
+    last_counted = get_ms_timer() - PULSE_MIN_IVAL;
+
     // clear and enable motor rotation interrupt
     GIFR = bit(INTF1);
     GIMSK |= bit(INT1);
@@ -300,26 +846,96 @@ static int get_position(void)
 
 ISR(INT1_vect)          // rotation pulse
 {
-    if (get_direction() == blc->up_dir)
+    unsigned int now;
+    unsigned long since;
+    long ms;
+
+    ISR_PROF_ENTER();
+
+    ms = get_ms_timer();
+    now = ms;
+    since = (unsigned long)ms - last_counted;   // set back?  huge
+    if (since < PULSE_MIN_IVAL) {
+        pulses_fast++;
+        ISR_PROF_EXIT(ISRP_INT1);
+        return;
+    }
+    if (since > PULSE_IDLE && !(PINMOTOR & bit(P_MOTOR_ON)) &&
+            !slow_active) {
+        pulses_idle++;
+        ISR_PROF_EXIT(ISRP_INT1);
+        return;
+    }
+    last_counted = ms;
+
+    last_ival = now - last_pulse;
+    if (PINMOTOR & bit(P_MOTOR_ON))
+        pulse_ival += ((int)last_ival - (int)pulse_ival) / 2;
+    last_pulse = now;
+
+    if (travel_dir == blc->up_dir)
         blc->position++;
     else
         blc->position--;
+    reset_pos = blc->position;
+    reset_chk = ~reset_pos;
 
     if (ignore_limit)
         ignore_limit--;
 
+    rotations++;
+
+#ifdef MOVE_TRACE
+    trace_entry(0, now);
+#endif
+
+    if (armed_dir && ((PINMOTOR & bit(P_MOTOR_ON)) || slow_active)) {
+        if (armed_dir == BLIND_IS_RISING ?
+                blc->position >= armed_stop :
+                blc->position <= armed_stop) {
+            PORTMOTOR &= ~bit(P_MOTOR_ON);
+            armed_dir = 0;
+            armed_hit = 1;
+            coast_from = blc->position;
+            coast_count = rotations;
+#ifdef MOVE_TRACE
+            trace_entry(TR_MARK | TR_GOAL, now);
+#endif
+        }
+    }
+
     blind_save_config();
 
+    post_event(EV_ROTATION);
+
+    ISR_PROF_EXIT(ISRP_INT1);
+
 }
 
 void config_process(void)
 {
-    // save current position 30 seconds after it stops changing
-    if (config_changed &&
-            check_timer(config_change_timer, 30*1000)) {
-        blind_save_config_real();
+    // save current position a while after it stops changing
+    if (config_changed) {
         config_changed = 0;
+        sw_timer_start(&config_timer, blind_save_config_real,
+                        CONFIG_SAVE_DELAY, 0);
     }
+
+#ifdef POWER_FAIL
+    if (power_failed == 1) {
+        power_failed = 2;
+        print_tstamp();
+        putstr("power fail!\n");
+        blind_do = BLIND_STOP;
+    } else if (power_failed == 2 && !(ACSRA & bit(ACO))) {
+        // it was just a dip, since we're still here.  keep watching.
+        power_failed = 0;
+        print_tstamp();
+        putstr("power ok\n");
+        ACSRA |= bit(ACI);
+        ACSRA |= bit(ACIE);
+    }
+#endif
 }
 
 void position_process(void)
@@ -332,6 +948,7 @@ void position_process(void)
         if (cur_pos != last_pos) {
             print_tstamp();
             p_hex(get_position());
+            crnl();
             last_pos = cur_pos;
         }
         position_report = 0;
@@ -344,6 +961,7 @@ void position_process(void)
  */
 static void stop_moving(void)
 {
+    armed_dir = 0;
     putstr("stop_moving\n");
     motor_next = MOTOR_STOPPED;
 }
@@ -361,6 +979,200 @@ static void start_moving_down(void)
 }
 
 
+/* hand the stopping point to the rotation interrupt handler */
+static void arm_goal(char dir, int stop)
+{
+    armed_stop = stop;
+    cli();
+    armed_dir = dir;
+    armed_hit = 0;
+    sei();
+}
+
+/*
+ * coast measurement
+ */
+static void coast_cancel(void)
+{
+    coast_dir = 0;
+    sw_timer_stop(&coast_timer);
+}
+
+// the spool should be at rest by now.  see how far it went.
+static void coast_done(void)
+{
+    int pos, coast, err, step, *learned;
+
+    cli();
+    coast = rotations - coast_count;
+    sei();
+
+    pos = get_position();
+    if (coast_dir == BLIND_IS_RISING) {
+        err = pos - goal;
+        coast_error_up = err;
+        learned = &blc->coast_up;
+    } else {
+        err = goal - pos;
+        coast_error_down = err;
+        learned = &blc->coast_down;
+    }
+
+    print_tstamp();
+    p_dec(coast);
+    p_hex(err);  // positive if past the goal
+    crnl();
+
+    // a running average, giving the newest measurement 1/4 weight.
+    // the step is rounded, not truncated toward zero, or it would
+    // never make up the last few sixteenths of a change.
+    if ((coast_from > move_from ? coast_from - move_from :
+            move_from - coast_from) >= COAST_MIN_MOVE) {
+        step = coast * COAST_SCALE - *learned;
+        *learned += (step < 0 ? step - 2 : step + 2) / 4;
+        if (*learned > COAST_MAX)
+            *learned = COAST_MAX;
+        blind_save_config();
+    }
+
+    coast_dir = 0;
+}
+
+// we've stopped at a goal, and should measure the coast
+static void coast_begin(char dir, int pos)
+{
+    coast_dir = dir;
+    cli();
+    if (!armed_hit) {   // we're late.  the handler didn't see the goal.
+        coast_from = pos;
+        coast_count = rotations;
+    }
+    armed_hit = 0;
+    sei();
+    sw_timer_start(&coast_timer, coast_done, COAST_SETTLE, 0);
+}
+
+/* monitor support:  show, or forget, the learned coast distances */
+void blind_show_coast(char forget)
+{
+    if (forget) {
+        blc->coast_up = COAST_DEFAULT;
+        blc->coast_down = COAST_DEFAULT;
+        blind_save_config();
+    }
+    p_dec(blc->coast_up);
+    p_dec(blc->coast_down);
+    crnl();
+    p_hex(coast_error_up);
+    p_hex(coast_error_down);
+    crnl();
+}
+
+/* monitor support:  show, and optionally reset, the counts of
+ * rejected rotation pulses */
+void blind_show_rejects(char reset)
+{
+    word too_fast, when_idle;
+
+    cli();
+    too_fast = pulses_fast;
+    when_idle = pulses_idle;
+    if (reset)
+        pulses_fast = pulses_idle = 0;
+    sei();
+
+    p_dec(too_fast);
+    p_dec(when_idle);
+    crnl();
+}
+
+/*
+ * the slow approach
+ */
+
+// switch the motor on or off, for the next part of the duty cycle
+static void slow_cycle(void)
+{
+    char on;
+
+    cli();
+    if (!armed_dir) {   // the handler has stopped at the goal
+        sei();
+        return;
+    }
+    on = !(PINMOTOR & bit(P_MOTOR_ON));
+    if (on)
+        PORTMOTOR |= bit(P_MOTOR_ON);
+    else
+        PORTMOTOR &= ~bit(P_MOTOR_ON);
+    sei();
+
+    sw_timer_start(&slow_timer, slow_cycle, on ? SLOW_ON : SLOW_OFF, 0);
+}
+
+// we're close to the goal.  start with the power off.
+static void slow_begin(void)
+{
+    if (slow_active)
+        return;
+    slow_active = 1;
+    trace_motor(TR_SLOW);
+    slow_cycle();
+}
+
+static void slow_end(void)
+{
+    sw_timer_stop(&slow_timer);
+    slow_active = 0;
+}
+
+/* monitor support:  show, or set, the slow approach distances.  the
+ * arrival errors are shown by blind_show_coast().  returns 0, and
+ * changes nothing, if either is out of range. */
+char blind_slow_approach(char set, int up, int down)
+{
+    if (set) {
+        if (up < 0 || up > SLOW_MAX || down < 0 || down > SLOW_MAX)
+            return 0;
+        blc->slow_up = up;
+        blc->slow_down = down;
+        blind_save_config();
+    }
+    p_dec(blc->slow_up);
+    p_dec(blc->slow_down);
+    crnl();
+    return 1;
+}
+
+/* monitor support:  show drift measurements.  1 starts (or
+ * restarts) them, and 2 stops them. */
+void blind_drift(char cmd)
+{
+    if (cmd == 1) {
+        drift.on = 1;
+        drift.visits = 0;
+        drift.total = drift.worst = 0;
+    } else if (cmd == 2) {
+        drift.on = 0;
+    }
+    drift.chk = drift_sum();
+    p_dec(drift.on);
+    p_dec(drift.visits);
+    crnl();
+    if (drift.visits) {
+        p_dec(drift.total);
+        p_dec(drift.worst);
+        crnl();
+    }
+    // and from the limit switch resets
+    if (blc->limit_chk == ~blc->limit_pos) {
+        p_hex(blc->limit_pos);
+        p_dec(limit_drift);
+        crnl();
+    }
+}
+
+
 /*
  * the blind state machine
  */
@@ -396,6 +1208,10 @@ static void blind_state(void)
     /* handle incoming commands */
     if (blind_do != BLIND_NOP) {
 
+        // a new command spoils any measurement in progress
+        coast_cancel();
+        move_from = pos;
+
         if (blind_do == BLIND_STOP) {
             // make sure STOP is always honored, and immediately
             stop_moving();
@@ -412,11 +1228,17 @@ static void blind_state(void)
             goal = blc->middle_stop;
         } else if (blind_do == BLIND_BOTTOM) {
             recent_goal = BLIND_BOTTOM;
-            goal = blc->bottom_stop;
+            goal = drift.on ? -MAXPOS : blc->bottom_stop;
         } else if (blind_do == BLIND_FORCE_UP) {
             goal = get_position() + inch_to_pulse(18);
         } else if (blind_do == BLIND_FORCE_DOWN) {
             goal = get_position() - inch_to_pulse(18);
+        } else if (blind_do == BLIND_BACKOFF) {
+            // away from the limit switch, toward the top stop
+            if (blc->top_stop > pos)
+                goal = pos + LIMIT_BACKOFF;
+            else
+                goal = pos - LIMIT_BACKOFF;
         }
 
         /* the actions for all commands (except BLIND_STOP) are
@@ -426,9 +1248,11 @@ static void blind_state(void)
             if (blind_at_limit())
                 ignore_limit = inch_to_pulse(2);
             start_moving_up();
+            arm_goal(blind_is, goal - coast_pulses(blc->coast_up));
         } else if (pos > goal && !blind_at_limit()) {
             blind_is = BLIND_IS_FALLING;
             start_moving_down();
+            arm_goal(blind_is, goal + coast_pulses(blc->coast_down));
         } else {
             blind_is = BLIND_IS_STOPPED;
             stop_moving();
@@ -450,15 +1274,27 @@ static void blind_state(void)
         }
         break;
     case BLIND_IS_FALLING:
-        if (blind_at_limit() || pos <= goal) {
+        if (blind_at_limit()) {
             stop_moving();
             blind_is = BLIND_IS_STOPPED;
+        } else if (armed_hit || pos <= armed_stop) {
+            stop_moving();
+            coast_begin(blind_is, pos);
+            blind_is = BLIND_IS_STOPPED;
+        } else if (blc->slow_down && pos <= armed_stop + blc->slow_down) {
+            slow_begin();
         }
         break;
     case BLIND_IS_RISING:
-        if ((blind_at_limit() && !ignore_limit) || pos >= goal) {
+        if (blind_at_limit() && !ignore_limit) {
             stop_moving();
             blind_is = BLIND_IS_STOPPED;
+        } else if (armed_hit || pos >= armed_stop) {
+            stop_moving();
+            coast_begin(blind_is, pos);
+            blind_is = BLIND_IS_STOPPED;
+        } else if (blc->slow_up && pos >= armed_stop - blc->slow_up) {
+            slow_begin();
         }
         break;
     }
@@ -466,6 +1302,103 @@ static void blind_state(void)
 }
 
 
+/*
+ * failsafe:  the motor has been running too long
+ */
+static void motor_runtime_expired(void)
+{
+    putstr("long run!\n");
+    armed_dir = 0;
+    motor_next = MOTOR_STOPPED;
+}
+
+/*
+ * failsafe:  the motor is on, but the spool isn't turning
+ */
+static void motor_stall_check(void)
+{
+    unsigned int since, ival;
+
+    cli();
+    since = (unsigned int)get_ms_timer() - last_pulse;
+    ival = pulse_ival;
+    sei();
+
+    // the slow approach leaves the motor off for a while
+    if (since > (slow_active ? SLOW_STALL : STALL_FACTOR * ival)) {
+        print_tstamp();
+        putstr("stall!\n");
+        p_dec(ival);
+        crnl();
+        armed_dir = 0;
+        motor_next = MOTOR_STOPPED;
+        sw_timer_stop(&stall_timer);
+    }
+}
+
+static void motor_stall_begin(void)
+{
+    cli();
+    last_pulse = get_ms_timer();
+    pulse_ival = STALL_START_IVAL;
+    sei();
+    sw_timer_start(&stall_timer, motor_stall_check,
+                    STALL_CHECK, STALL_CHECK);
+}
+
+/*
+ * wait for prior transitions to complete.  the spool has settled
+ * once the rotation pulses have gone quiet -- none for twice the
+ * last interval between them.  the relays always get SETTLE_MIN,
+ * and we never wait longer than the given maximum.  the timer only
+ * wakes us to look again, and only while someone is waiting:  once
+ * the motor is stopped for good, nothing asks, and it stays off.
+ */
+#define SETTLE_MIN      20      // ms, for the relay contacts
+#define SETTLE_MAX      50      // ms
+#define SETTLE_MAX_STOP 250     // ms, for a heavy blind to come to rest
+#define SETTLE_CHECK    5       // ms between checks
+
+static unsigned int settle_start, settle_max;
+static char settling;
+
+// how long a reversal took, from power off to power on
+static unsigned int reverse_start;
+static char reversing;
+
+static void motor_settle(unsigned int max)
+{
+    settle_start = get_ms_timer();
+    settle_max = max;
+    settling = 1;
+    sw_timer_start(&motor_timer, 0, SETTLE_MIN, 0);
+}
+
+static char motor_settling(void)
+{
+    unsigned int now, since, quiet, waited;
+
+    if (!settling)
+        return 0;
+
+    now = get_ms_timer();
+    cli();
+    since = now - last_pulse;
+    quiet = 2 * last_ival;
+    sei();
+
+    waited = now - settle_start;
+    if (waited < SETTLE_MIN || (since < quiet && waited < settle_max)) {
+        if (!sw_timer_pending(&motor_timer))
+            sw_timer_start(&motor_timer, 0, SETTLE_CHECK, 0);
+        return 1;
+    }
+
+    sw_timer_stop(&motor_timer);
+    settling = 0;
+    return 0;
+}
+
 /*
  * the motor state machine
  */
@@ -485,12 +1418,6 @@ static void motor_state(void)
         }
     }
 
-    if (motor_cur != MOTOR_STOPPED &&
-            check_timer(motor_state_timer, MAX_RUNTIME)) {
-        putstr("long run!\n");
-        motor_next = MOTOR_STOPPED;
-    }
-
     if (motor_next == motor_cur) {
         return;
     }
@@ -502,59 +1429,88 @@ static void motor_state(void)
         // throwing it into reverse.
         // stopping involves first removing power
         set_motion(0);
+        sw_timer_stop(&runtime_timer);
+        sw_timer_stop(&stall_timer);
+        slow_end();
+
+        reverse_start = get_ms_timer();
+        reversing = (motor_next != MOTOR_STOPPED);
 
         motor_cur = MOTOR_STOPPING;
+        trace_motor(motor_cur);
 
-        // schedule the next transition
-        motor_state_timer = get_ms_timer();
+        // schedule the next transition.  if the spool's still
+        // turning, don't wait long -- that's what the brake is for.
+        motor_settle(SETTLE_MAX);
         break;
 
     case MOTOR_STOPPING:
         // wait for prior transitions to complete...
-        if (check_timer(motor_state_timer, 50)) {
+        if (!motor_settling()) {
             // ...then we reverse the direction relay to force a stop.
             // this essentially applies the brakes -- power was removed
             // above.
             set_direction(!get_direction());
 
             motor_cur = MOTOR_BRAKING;
+            trace_motor(motor_cur);
             // schedule the next transition
-            motor_state_timer = get_ms_timer();
+            motor_settle(SETTLE_MAX_STOP);
         }
         break;
     case MOTOR_BRAKING:
         // wait for prior transitions to complete...
-        if (check_timer(motor_state_timer, 50)) {
+        if (!motor_settling()) {
             // ...then we idle the direction relay
             set_direction(0);
 
             motor_cur = MOTOR_STOPPED;
+            trace_motor(motor_cur);
+            set_driving(0);
             // schedule the next transition
-            motor_state_timer = get_ms_timer();
+            motor_settle(SETTLE_MAX);
         }
         break;
 
     case MOTOR_STOPPED:
         // wait for prior transitions to complete...
-        if (check_timer(motor_state_timer, 50)) {
+        if (!motor_settling()) {
 
             // ...and now we're stopped, and want to start.
             // set direction first
             if (motor_next == MOTOR_UP && get_direction() != blc->up_dir) {
                 set_direction(blc->up_dir);
+                motor_settle(SETTLE_MIN);
                 break;
             }
             if (motor_next == MOTOR_DOWN && get_direction() != !blc->up_dir) {
                 set_direction(!blc->up_dir);
+                motor_settle(SETTLE_MIN);
                 break;
             }
             // we're stopped, and the direction is set.  let's go!
             if (motor_next != MOTOR_STOPPED) {
                 motor_cur = motor_next;
+                trace_motor(motor_cur);
+                set_driving(1);
+                travel_dir = get_direction();
                 set_motion(1);
+                sw_timer_start(&runtime_timer, motor_runtime_expired,
+                                MAX_RUNTIME, 0);
+                motor_stall_begin();
+                if (reversing) {
+                    unsigned int reverse_ms;
+
+                    reverse_ms = get_ms_timer() - reverse_start;
+                    print_tstamp();
+                    putstr("reversed\n");
+                    p_dec(reverse_ms);
+                    crnl();
+                }
             }
+            reversing = 0;
             // schedule the next transition
-            motor_state_timer = get_ms_timer();
+            motor_settle(SETTLE_MAX);
         }
         break;
     }
@@ -593,16 +1549,19 @@ static void blind_button(void)
  * we use just 5 IR buttons:  three should take us to the "top",
  * "middle", and "bottom" positions, as well as "stop" and "alt".
  */
+static struct sw_timer alt_timer;
+static char alt;
+
+// too long since the last ALT press -- abandon the sequence
+static void alt_expired(void)
+{
+    tone_start(TONE_ABORT);
+    alt = 0;
+}
+
 static void blind_ir(void)
 {
     char ir;
-    static long alt_timer;
-    static char alt;
-
-    if (alt && check_timer(alt_timer, 1000)) {
-        tone_start(TONE_ABORT);
-        alt = 0;
-    }
 
     ir = get_ir();
     if (!ir)
@@ -666,6 +1625,8 @@ static void blind_ir(void)
                 } else if (alt == 3) {     // alt alt alt stop
                     do_blind_cmd(BL_INVERT);
                     tone_start(TONE_CONFIRM);
+                } else if (alt == 4) {     // alt alt alt alt stop
+                    ir_learn(1);
                 } else {
                     tone_start(TONE_ABORT);
                     break;
@@ -679,11 +1640,12 @@ static void blind_ir(void)
     case IR_ALT:
             alt++;
             tone_start(TONE_CHIRP);
-            alt_timer = get_ms_timer();
+            sw_timer_start(&alt_timer, alt_expired, 1000, 0);
             return;
     }
 
     alt = 0;
+    sw_timer_stop(&alt_timer);
 }
 
 
@@ -698,6 +1660,13 @@ void blind_commands(void)
     if (!blind_cmd)
         return;
 
+#ifdef POWER_FAIL
+    if (power_failed) {     // don't start anything now
+        blind_cmd = 0;
+        return;
+    }
+#endif
+
     cmd = blind_cmd;
     blind_cmd = 0;
 
@@ -780,6 +1749,10 @@ void blind_process(void)
 
     blind_state();
 
+    // if the motor state machine has more to do, and isn't
+    // waiting for a timer, then it needs another pass right away
+    if (motor_next != motor_cur && !motor_settling())
+        post_event(EV_BLIND);
 }
 
 // vile:noti:sw=4
@@ -6,7 +6,6 @@
  */
 extern char blind_state_debug;
 extern char blind_motor_debug;
-extern long motor_state_timer;
 
 void blind_init(void);
 void blind_process(void);
@@ -14,6 +13,13 @@ void blind_save_config(void);
 void blind_read_config(void);
 char blind_at_limit(void);
 void dump_config(void);
+void blind_show_coast(char forget);
+char blind_slow_approach(char set, int up, int down);
+void blind_drift(char cmd);
+void blind_show_rejects(char reset);
+#ifdef MOVE_TRACE
+void blind_show_trace(void);
+#endif
 
 enum {
     BL_STOP = 1,
@@ -7,10 +7,7 @@
  * -----------
  */
 
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <avr/pgmspace.h>
-#include <avr/sleep.h>
+#include "hal.h"
 #include "common.h"
 #include "timer.h"
 #include "util.h"
@@ -33,15 +30,38 @@ enum {
 
 static char button_code;
 
+static struct sw_timer button_timer;
+static long button_press_time;
+
 void button_init(void)
 {
     BUTTON_PORT |= bit(BUTTON_BIT); // enable pullup
+
+    // wake up on any change of the button pin.  the two pin
+    // change enables cover oddly split groups of pins, so
+    // enable both, and let the masks select just the button.
+    PCMSK0 = 0;
+    BUTTON_PCMSK = bit(BUTTON_PCINT);
+    GIFR = bit(PCIF);
+    GIMSK |= bit(PCIE0) | bit(PCIE1);
 }
 
+ISR(PCINT_vect)
+{
+    ISR_PROF_ENTER();
+
+    post_event(EV_BUTTON);
+
+    ISR_PROF_EXIT(ISRP_PCINT);
+}
+
+/*
+ * runs on any change of the button pin, and when the debounce
+ * timer expires.
+ */
 void button_process(void)
 {
     static char button_state;
-    static long button_timer;
 
     char button_down;
 
@@ -59,18 +79,20 @@ void button_process(void)
     case BUTTON_IS_UP:
         if (button_down) {
             // putstr("start button debounce\n");
-            button_timer = get_ms_timer();
+            button_press_time = get_ms_timer();
+            sw_timer_start(&button_timer, button_process, 50, 0);
             button_state = BUTTON_IS_DEBOUNCING;
         }
         break;
 
     case BUTTON_IS_DEBOUNCING:
         if (!button_down) {  // button went up too soon
+            sw_timer_stop(&button_timer);
             button_state = BUTTON_IS_UP;
             break;
         }
 
-        if (check_timer(button_timer, 50)) { // it's been down 50ms
+        if (!sw_timer_pending(&button_timer)) { // it's been down 50ms
             button_state = BUTTON_IS_DOWN;
             // putstr("button asserted\n");
         }
@@ -84,7 +106,7 @@ void button_process(void)
         button_state = BUTTON_IS_UP;
 
         // check for a long press first
-        if (check_timer(button_timer, 1000)) {
+        if (check_timer(button_press_time, 1000)) {
             putstr("long button\n");
             button_code = BUTTON_LONG;
             break;
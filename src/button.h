@@ -12,6 +12,8 @@
 #define BUTTON_PIN          PINB
 #define BUTTON_BIT          PB2 // input:  from pushbutton
 #define read_button()       !(BUTTON_PIN & bit(BUTTON_BIT))
+#define BUTTON_PCMSK        PCMSK1
+#define BUTTON_PCINT        PCINT10 // PB2
 
 void button_process(void);
 void button_init(void);
@@ -15,6 +15,34 @@ typedef uint8_t byte;
 
 void monitor(void);
 
+/*
+ * events, posted (mostly by interrupt handlers) to wake the main
+ * loop.  each of the main loop's tasks runs only when one of the
+ * events it cares about has been posted.
+ */
+extern volatile byte pending_events;
+#define EV_TIMER    bit(0)  // a software timer is due
+#define EV_SERIAL   bit(1)  // serial character received
+#define EV_IR       bit(2)  // IR edge captured
+#define EV_ROTATION bit(3)  // motor rotation pulse
+#define EV_BUTTON   bit(4)  // pushbutton pin changed
+#define EV_BLIND    bit(5)  // blind state machine wants another pass
+#define EV_ANY      0xff
+#define post_event(e) do {                      \
+        char _sreg = SREG;                      \
+        cli();                                  \
+        pending_events |= (e);                  \
+        SREG = _sreg;                           \
+    } while(0)
+
+extern word wakeups_per_sec;
+extern byte busy_percent;
+extern byte saved_mcusr;
+
+#ifdef LOOP_PROFILE
+void loop_profile_show(void);
+#endif
+
 void force_reboot(void);
 
 #ifdef USE_PRINTF
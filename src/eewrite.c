@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2013 Paul Fox, pgf@foxharp.boston.ma.us
+ *
+ * Licensed under GPL version 2, see accompanying LICENSE file
+ * for details.
+ */
+
+#include "hal.h"
+#include "common.h"
+#include "timer.h"
+#include "eewrite.h"
+
+/*
+ * each eeprom byte takes 3.4ms to write, and avr-libc's routines
+ * busy-wait for every one of them.  instead, the blocks to be
+ * written are queued here, and the EE_RDY interrupt writes them a
+ * byte at a time, while the main loop carries on.  like
+ * eeprom_update_block(), bytes that already hold the right value
+ * aren't rewritten.
+ *
+ * one more block, an urgent one, has a slot of its own.  it goes
+ * ahead of the queue, even of a block part way written, so a
+ * power failure's journal record waits for at most the byte
+ * already being written.
+ */
+#define EE_BLOCKS 4
+
+static struct {
+    const byte *src;
+    word addr;
+    byte n;
+} ee_blocks[EE_BLOCKS];
+
+static volatile byte ee_count;  // queued blocks
+static byte ee_cur;             // the block being written
+static const byte *ee_src;      // ...and our place in it
+static word ee_addr;
+static byte ee_left;
+
+static const byte *ee_urgent_src;
+static word ee_urgent_addr;
+static volatile byte ee_urgent_left;
+
+/*
+ * queue a block for writing.  returns 0 if the queue is full.  a
+ * block queued while others are being written is written after them.
+ */
+char ee_write(const void *src, word addr, byte n)
+{
+    char sreg;
+    char ok = 0;
+
+    sreg = SREG;
+    cli();
+    if (ee_count < EE_BLOCKS) {
+        ee_blocks[ee_count].src = src;
+        ee_blocks[ee_count].addr = addr;
+        ee_blocks[ee_count].n = n;
+        ee_count++;
+        EECR |= bit(EERIE);
+        ok = 1;
+    }
+    SREG = sreg;
+
+    return ok;
+}
+
+/*
+ * queue the urgent block.  returns 0 if the last one hasn't been
+ * written yet.
+ */
+char ee_write_urgent(const void *src, word addr, byte n)
+{
+    char sreg;
+    char ok = 0;
+
+    sreg = SREG;
+    cli();
+    if (!ee_urgent_left) {
+        ee_urgent_src = src;
+        ee_urgent_addr = addr;
+        ee_urgent_left = n;
+        EECR |= bit(EERIE);
+        ok = 1;
+    }
+    SREG = sreg;
+
+    return ok;
+}
+
+char ee_busy(void)
+{
+    return ee_count != 0 || ee_urgent_left != 0;
+}
+
+ISR(EE_RDY_vect)
+{
+    byte b;
+
+    ISR_PROF_ENTER();
+
+    for (;;) {
+        if (ee_urgent_left) {
+            b = *ee_urgent_src++;
+            ee_urgent_left--;
+            EEAR = ee_urgent_addr++;
+        } else if (ee_left) {
+            b = *ee_src++;
+            ee_left--;
+            EEAR = ee_addr++;
+        } else if (ee_cur != ee_count) {
+            ee_src = ee_blocks[ee_cur].src;
+            ee_addr = ee_blocks[ee_cur].addr;
+            ee_left = ee_blocks[ee_cur].n;
+            ee_cur++;
+            continue;
+        } else {                        // all done
+            ee_cur = ee_count = 0;
+            EECR &= ~bit(EERIE);
+            break;
+        }
+
+        EECR |= bit(EERE);
+        if (EEDR != b) {
+            EEDR = b;
+            // EEPE must be set within 4 cycles of EEMPE
+            EECR |= bit(EEMPE);
+            EECR |= bit(EEPE);
+            break;
+        }
+    }
+
+    ISR_PROF_EXIT(ISRP_EE_RDY);
+}
+
+// vile:noti:sw=4
@@ -0,0 +1,18 @@
+/*
+ * Copyright (c) 2013 Paul Fox, pgf@foxharp.boston.ma.us
+ *
+ * Licensed under GPL version 2, see accompanying LICENSE file
+ * for details.
+ */
+
+/*
+ * background eeprom writes.  ee_write() queues a block, and
+ * returns right away.  the caller must leave the data alone until
+ * ee_busy() says the queue has drained.
+ */
+char ee_write(const void *src, word addr, byte n);
+// one block that goes ahead of all the others
+char ee_write_urgent(const void *src, word addr, byte n);
+char ee_busy(void);
+
+// vile:noti:sw=4
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2013 Paul Fox, pgf@foxharp.boston.ma.us
+ *
+ * Licensed under GPL version 2, see accompanying LICENSE file
+ * for details.
+ */
+
+/*
+ * hardware abstraction.  on the AVR, this is just the avr-libc
+ * headers, and the firmware uses the chip's registers directly.
+ * for "make host", the same register names are provided by a
+ * simulated attiny861 (see host/sim.h), so that the state
+ * machines, IR decoder, and monitor can be run and measured on
+ * a linux box.
+ *
+ * the few operations whose meaning isn't just "read or write a
+ * byte" go through the macros below, so the simulation can see
+ * them.
+ */
+
+#ifdef HOST_BUILD
+
+#include "host/sim.h"
+
+#define hal_spin()                  sim_spin()
+#define pin_toggle(pinreg, mask)    sim_pin_toggle(&(pinreg), mask)
+#define hal_task_enter(func)        sim_task_enter(func)
+#define hal_task_exit(func)         sim_task_exit(func)
+#define sram_ptr(addr)  (&sim_sram[(addr) % sizeof(sim_sram)])
+#define flash_ptr(addr) (&sim_flash[(addr) % sizeof(sim_flash)])
+#define NOINIT          // the simulation never resets
+
+#else
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include <avr/eeprom.h>
+#include <avr/power.h>
+#include <util/crc16.h>
+
+// the body of a busy-wait loop.  nothing to do on real hardware,
+// where the interrupts we're waiting for just happen.
+#define hal_spin()  do { } while (0)
+
+// toggle output pins, by writing ones to the PIN register
+#define pin_toggle(pinreg, mask)  do { pinreg = (mask); } while (0)
+
+// main loop task boundaries, for the simulation's measurements
+#define hal_task_enter(func)
+#define hal_task_exit(func)
+
+// raw memory access, for the monitor
+#define sram_ptr(addr)  ((unsigned char *)(addr))
+#define flash_ptr(addr) ((const unsigned char *)(addr))
+
+// variables that keep their contents across a reset (but not a
+// power cycle)
+#define NOINIT  __attribute__((section(".noinit")))
+
+#endif
+
+#ifndef pgm_read_ptr
+#define pgm_read_ptr(p) ((void *)pgm_read_word(p))
+#endif
+
+// vile:noti:sw=4
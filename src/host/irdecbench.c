@@ -0,0 +1,447 @@
+/*
+ * Copyright (c) 2013 Paul Fox, pgf@foxharp.boston.ma.us
+ *
+ * Licensed under GPL version 2, see accompanying LICENSE file
+ * for details.
+ */
+
+/*
+ * irdecbench.c - measure the IR decoders in irdecode.c.
+ *
+ *      irdecbench [-n frames] [-s seed]
+ *      irdecbench file.mode2 ...
+ *
+ * with no files, frames of each protocol are made up, with random
+ * codes, and given to the decoders with the sort of timing errors
+ * a receiver adds:  marks stretched and spaces shrunk by a skew,
+ * and every pulse off by some random jitter.  for each protocol,
+ * and a few amounts of error, the frames decoded correctly,
+ * decoded wrongly, and missed are counted.  trains of random
+ * pulses are fed in too, to count false decodes.  frames the
+ * protocol's own decoder misses, but the catch-all "other" decoder
+ * gets right (as ir.c used to), are counted separately.  so are
+ * wrong codes, from any decoder.  and so are frames that were known
+ * to be over at their last edge, so ir.c needn't wait for a quiet
+ * line.
+ *
+ * with files, each one is the output of lirc's mode2 ("pulse 560",
+ * "space 1690", ...), from a real receiver, or the same from the
+ * firmware's own, if it's built with IR_CAPTURE.  every frame in it is
+ * decoded and shown.  a space of 10ms or more ends a frame, as in
+ * ir.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../hal.h"
+#include "../common.h"
+#include "../irdecode.h"
+
+#define FRAME_GAP   10000       // as IR_FRAME_GAP in ir.c
+#define MAX_PULSES  200
+
+static const char *proto_names[IRP_COUNT] = {
+    "none", "nec", "samsung", "sirc", "kaseikyo", "rc5", "rc6", "other"
+};
+
+// a frame's pulses.  even ones are marks, odd ones are spaces.
+static int pulses[MAX_PULSES];
+static int npulses;
+
+static unsigned long rand_state = 1;
+
+static unsigned long rnd(void)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return rand_state;
+}
+
+static int rnd_range(int lo, int hi)
+{
+    return lo + (int)(rnd() % (unsigned long)(hi - lo + 1));
+}
+
+static void put(int mark, int len)
+{
+    if (npulses == 0 && !mark)         // the line is idle before a frame
+        return;
+    if (npulses && ((npulses - 1) & 1) == !mark) {
+        pulses[npulses - 1] += len;     // same level as the last one
+        return;
+    }
+    if (npulses < MAX_PULSES)
+        pulses[npulses++] = len;
+}
+
+static void put_bits(unsigned long long v, int nbits, int unit, int one,
+                int by_mark)
+{
+    int i, b;
+
+    for (i = nbits - 1; i >= 0; i--) {
+        b = (v >> i) & 1;
+        if (by_mark) {
+            put(1, b ? one : unit);
+            put(0, unit);
+        } else {
+            put(1, unit);
+            put(0, b ? one : unit);
+        }
+    }
+}
+
+static void put_biphase(unsigned long v, int nbits, int unit, int mark_one,
+                int trailer)
+{
+    int i, b, w;
+
+    for (i = nbits - 1; i >= 0; i--) {
+        b = (v >> i) & 1;
+        w = (trailer && i == nbits - 5) ? 2 * unit : unit;
+        put(b == mark_one, w);
+        put(b != mark_one, w);
+    }
+}
+
+/*
+ * the protocols' frames.  each returns the code the decoder should
+ * report.
+ */
+static int32_t nec(unsigned long code, int hdr_mark)
+{
+    put(1, hdr_mark);
+    put(0, 4500);
+    put_bits(code, 32, 560, 1690, 0);
+    put(1, 560);
+    return code;
+}
+
+static int32_t nec_repeat(void)
+{
+    put(1, 9000);
+    put(0, 2250);
+    put(1, 560);
+    return 0;
+}
+
+static int32_t sirc(unsigned long code, int nbits)
+{
+    code &= (1UL << nbits) - 1;
+    put(1, 2400);
+    put(0, 600);
+    put_bits(code, nbits, 600, 1200, 1);
+    return code;
+}
+
+static int32_t kaseikyo(unsigned long code)
+{
+    unsigned long long v;
+
+    v = ((unsigned long long)0x4004 << 32) | code;     // panasonic
+    put(1, 3456);
+    put(0, 1728);
+    put_bits(v, 48, 432, 1296, 0);
+    put(1, 432);
+    return code;
+}
+
+// 13 bits:  field, toggle, address, and command
+static int32_t rc5(unsigned long code, int toggle)
+{
+    code &= 0x17ff;
+    put_biphase(0x2000 | code | (toggle << 11), 14, 889, 0, 0);
+    return code;
+}
+
+// mode 0:  leader, mode, toggle, address, command
+static int32_t rc6(unsigned long code, int toggle)
+{
+    code = 0x100000 | (code & 0xffff);
+    put(1, 2666);
+    put(0, 889);
+    put_biphase(code | ((unsigned long)toggle << 16), 21, 444, 1, 1);
+    return code;
+}
+
+// jvc, which we only know as "some other" protocol
+static int32_t jvc(unsigned long code)
+{
+    code &= 0xffff;
+    put(1, 8400);
+    put(0, 4200);
+    put_bits(code, 16, 526, 1574, 0);
+    put(1, 526);
+    return code;
+}
+
+// a receiver's timing errors
+static void distort(int skew, int jitter)
+{
+    int i;
+
+    for (i = 0; i < npulses; i++) {
+        pulses[i] += (i & 1) ? -skew : skew;
+        if (jitter)
+            pulses[i] += rnd_range(-jitter, jitter);
+        if (pulses[i] < 50)
+            pulses[i] = 50;
+    }
+}
+
+static long edges;
+static int ended_early;     // the decoders knew the frame was over
+
+static char decode(struct ir_frame *f)
+{
+    int i;
+
+    ended_early = 0;
+    for (i = 0; i < npulses; i++)
+        if (ir_decode_edge(!(i & 1), pulses[i]) == IR_DECODE_DONE)
+            ended_early = 1;
+    edges += npulses;
+    npulses = 0;
+
+    memset(f, 0, sizeof(*f));
+    return ir_decode_end(f);
+}
+
+enum {
+    T_NEC, T_NEC_REPEAT, T_SAMSUNG, T_SIRC12, T_SIRC15, T_SIRC20,
+    T_KASEIKYO, T_RC5, T_RC5_HELD, T_RC6, T_RC6_HELD, T_JVC, T_COUNT
+};
+
+static const struct {
+    const char *name;
+    byte proto;
+} tests[T_COUNT] = {
+    { "nec",            IRP_NEC },
+    { "nec repeat",     IRP_NEC },
+    { "samsung",        IRP_SAMSUNG },
+    { "sirc 12",        IRP_SIRC },
+    { "sirc 15",        IRP_SIRC },
+    { "sirc 20",        IRP_SIRC },
+    { "kaseikyo",       IRP_KASEIKYO },
+    { "rc5",            IRP_RC5 },
+    { "rc5 held",       IRP_RC5 },
+    { "rc6",            IRP_RC6 },
+    { "rc6 held",       IRP_RC6 },
+    { "jvc (other)",    IRP_OTHER },
+};
+
+// make one frame for the test, with the given errors, and decode it
+static int run_one(int t, int skew, int jitter)
+{
+    static int toggle;
+    struct ir_frame f;
+    unsigned long code;
+    int32_t want;
+    int repeat = 0;
+
+    code = rnd();
+
+    switch (t) {
+    case T_NEC:         want = nec(code, 9000); break;
+    case T_NEC_REPEAT:  want = nec_repeat(); repeat = 1; break;
+    case T_SAMSUNG:     want = nec(code, 4500); break;
+    case T_SIRC12:      want = sirc(code, 12); break;
+    case T_SIRC15:      want = sirc(code, 15); break;
+    case T_SIRC20:      want = sirc(code, 20); break;
+    case T_KASEIKYO:    want = kaseikyo(code); break;
+    case T_JVC:         want = jvc(code); break;
+
+    case T_RC5:
+    case T_RC6:
+    case T_RC5_HELD:
+    case T_RC6_HELD:
+        // a new press flips the toggle.  a held button sends the
+        // same frame again.
+        toggle = !toggle;
+        if (t == T_RC5_HELD || t == T_RC6_HELD) {
+            if (t == T_RC5_HELD)
+                rc5(code, toggle);
+            else
+                rc6(code, toggle);
+            distort(skew, jitter);
+            decode(&f);
+            repeat = 1;
+        }
+        if (t == T_RC5 || t == T_RC5_HELD)
+            want = rc5(code, toggle);
+        else
+            want = rc6(code, toggle);
+        break;
+
+    default:
+        return 0;
+    }
+
+    distort(skew, jitter);
+    if (!decode(&f))
+        return 0;       // missed
+    if (f.repeat != repeat || f.code != want)
+        return -1;      // wrong
+    if (f.proto != tests[t].proto)
+        return 2;       // right code, but only by the catch-all decoder
+    return 1;
+}
+
+// random pulses, which shouldn't decode as anything
+static int run_noise(void)
+{
+    struct ir_frame f;
+    int i, n;
+
+    n = rnd_range(4, 80);
+    for (i = 0; i < n; i++)
+        put(!(i & 1), rnd_range(100, 9999));
+    return decode(&f);
+}
+
+static void bench(int nframes)
+{
+    static const struct { int skew, jitter; } errs[] = {
+        { 0, 0 }, { 50, 50 }, { 100, 100 }, { 150, 150 }, { 200, 100 },
+    };
+    int e, t, i, r, ok, other, wrong, missed, early, early0 = 0;
+    struct timespec t0, t1;
+    char cell[64];
+    double ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    printf("%d frames of each, with skew/jitter in usecs:\n", nframes);
+    printf("  ok%% (by \"other\", wrong, missed), and at the right,\n");
+    printf("  %% known to be over at their last edge (with no errors)\n\n");
+    printf("%-14s", "");
+    for (e = 0; e < sizeof(errs) / sizeof(errs[0]); e++)
+        printf("  %9d/%-8d", errs[e].skew, errs[e].jitter);
+    printf("\n");
+
+    for (t = 0; t < T_COUNT; t++) {
+        printf("%-14s", tests[t].name);
+        for (e = 0; e < sizeof(errs) / sizeof(errs[0]); e++) {
+            ok = other = wrong = missed = early = 0;
+            for (i = 0; i < nframes; i++) {
+                r = run_one(t, errs[e].skew, errs[e].jitter);
+                early += ended_early;
+                if (r == 1)
+                    ok++;
+                else if (r == 2)
+                    other++;
+                else if (r < 0)
+                    wrong++;
+                else
+                    missed++;
+            }
+            snprintf(cell, sizeof(cell), "%5.1f (%d,%d,%d)",
+                    100.0 * ok / nframes, other, wrong, missed);
+            printf("  %-18s", cell);
+            if (e == 0)
+                early0 = early;
+        }
+        printf("  %5.1f\n", 100.0 * early0 / nframes);
+    }
+
+    r = 0;
+    for (i = 0; i < nframes; i++)
+        r += run_noise();
+    printf("\nrandom pulses:  %d of %d decoded as something\n", r, nframes);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    printf("%ld edges, %.1f ns each (on this machine)\n", edges, ns / edges);
+}
+
+static void show(struct ir_frame *f)
+{
+    printf("%-8s %2d bits  addr 0x%04x  cmd 0x%04x  code 0x%08x%s\n",
+            proto_names[f->proto], f->nbits, f->addr, f->cmd,
+            (unsigned)f->code, f->repeat ? "  repeat" : "");
+}
+
+static void decode_file(const char *file)
+{
+    struct ir_frame f;
+    char line[100], what[20];
+    long len;
+    int mark;
+    FILE *fp;
+
+    fp = fopen(file, "r");
+    if (!fp) {
+        perror(file);
+        exit(1);
+    }
+
+    printf("%s:\n", file);
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%19s %ld", what, &len) != 2)
+            continue;
+        if (!strcmp(what, "pulse"))
+            mark = 1;
+        else if (!strcmp(what, "space"))
+            mark = 0;
+        else if (!strcmp(what, "timeout"))
+            mark = 0, len = FRAME_GAP;
+        else
+            continue;
+
+        if (!mark && len >= FRAME_GAP) {
+            if (npulses && decode(&f))
+                show(&f);
+            npulses = 0;
+            continue;
+        }
+        if (len > 0xffff)
+            len = 0xffff;
+        put(mark, len);
+    }
+    if (npulses && decode(&f))
+        show(&f);
+    npulses = 0;
+
+    fclose(fp);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: irdecbench [-n frames] [-s seed]\n");
+    fprintf(stderr, "       irdecbench file.mode2 ...\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int c, nframes = 10000;
+
+    while ((c = getopt(argc, argv, "n:s:")) != -1) {
+        switch (c) {
+        case 'n':
+            nframes = atoi(optarg);
+            break;
+        case 's':
+            rand_state = strtoul(optarg, NULL, 0) | 1;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (optind == argc) {
+        bench(nframes);
+        return 0;
+    }
+
+    for (; optind < argc; optind++)
+        decode_file(argv[optind]);
+    return 0;
+}
+
+// vile:noti:sw=4
@@ -0,0 +1,555 @@
+/*
+ * Copyright (c) 2013 Paul Fox, pgf@foxharp.boston.ma.us
+ *
+ * Licensed under GPL version 2, see accompanying LICENSE file
+ * for details.
+ */
+
+/*
+ * irtable.c - build the firmware's IR code table.
+ *
+ * reads lircd.conf-style remote descriptions, and a map of which
+ * remote buttons should do what, and writes ir_table.h:  a perfect
+ * hash table of the codes the decoder in ir.c will report for those
+ * buttons (see irhash.h).
+ *
+ *      irtable [-b] map-file lircd.conf ...
+ *
+ * the map file has a line for each button, naming the remote, the
+ * button, and the command:  top, middle, bottom, stop, or alt.
+ *
+ * the decoders in irdecode.c keep the bits in the order they
+ * arrive, as lirc does, and report the last 32 of them (of at most
+ * 48).  so a remote that lirc describes as SPACE_ENC (which includes
+ * the pulse-width encoded sony remotes), RC5, or RC6 can be used,
+ * and its codes become the pre_data, data, and post_data bits, in
+ * that order, without the toggle bit.
+ *
+ * with -b, the table isn't written.  instead, lookups are timed on
+ * this machine, against a linear scan of the same codes, which is
+ * how the firmware used to do it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../irhash.h"
+
+#define IR_MAX_BITS 48      // the longest frame irdecode.c takes
+#define MAX_CODES   250     // slots are bytes
+
+static const char *commands[] = {
+    "top", "middle", "bottom", "stop", "alt", NULL
+};
+
+struct button {
+    char *name;
+    unsigned long long value;
+};
+
+struct remote {
+    char *name;
+    char *file;
+    int bits, pre_data_bits, post_data_bits;
+    unsigned long long pre_data, post_data;
+    unsigned long long toggle_bit_mask;
+    const char *bad_flag;   // an encoding we can't decode
+    struct button *buttons;
+    int nbuttons;
+};
+
+static struct remote *remotes;
+static int nremotes;
+
+static struct code {
+    uint32_t code;
+    const char *cmd;
+    const char *remote, *button;
+    uint16_t hash;
+} codes[MAX_CODES], *table[MAX_CODES];
+static int ncodes;
+
+static int nbuckets;
+static uint16_t seed;
+static uint8_t disp[MAX_CODES];
+
+static const char *fname;
+static int lineno;
+
+static void die(const char *fmt, ...)
+{
+    va_list ap;
+
+    if (fname)
+        fprintf(stderr, "%s:%d: ", fname, lineno);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+static void *xrealloc(void *p, size_t n)
+{
+    p = realloc(p, n);
+    if (!p)
+        die("out of memory");
+    return p;
+}
+
+static char *xstrdup(const char *s)
+{
+    return strcpy(xrealloc(NULL, strlen(s) + 1), s);
+}
+
+// split a line into at most n words, dropping comments
+static int words(char *line, char **w, int n)
+{
+    int i = 0;
+    char *p;
+
+    if ((p = strchr(line, '#')))
+        *p = '\0';
+    for (p = strtok(line, " \t\r\n"); p && i < n; p = strtok(NULL, " \t\r\n"))
+        w[i++] = p;
+    return i;
+}
+
+static unsigned long long number(const char *s)
+{
+    char *end;
+    unsigned long long n;
+
+    n = strtoull(s, &end, 0);
+    if (*end)
+        die("bad number \"%s\"", s);
+    return n;
+}
+
+static void read_conf(const char *file)
+{
+    FILE *f;
+    char line[256], *w[4], *p;
+    struct remote *r = NULL;
+    struct button *b;
+    int n, in_codes = 0;
+
+    f = fopen(file, "r");
+    if (!f) {
+        perror(file);
+        exit(1);
+    }
+    fname = file;
+    lineno = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        n = words(line, w, 4);
+        if (!n)
+            continue;
+
+        if (!r) {
+            if (n == 2 && !strcmp(w[0], "begin") && !strcmp(w[1], "remote")) {
+                remotes = xrealloc(remotes, (nremotes + 1) * sizeof(*r));
+                r = &remotes[nremotes++];
+                memset(r, 0, sizeof(*r));
+                r->file = xstrdup(file);
+            }
+            continue;
+        }
+
+        if (n == 2 && !strcmp(w[0], "end")) {
+            if (!strcmp(w[1], "codes"))
+                in_codes = 0;
+            else if (!strcmp(w[1], "remote")) {
+                if (!r->name)
+                    die("remote has no name");
+                r = NULL;
+            }
+            continue;
+        }
+
+        if (in_codes) {
+            r->buttons = xrealloc(r->buttons,
+                            (r->nbuttons + 1) * sizeof(*b));
+            b = &r->buttons[r->nbuttons++];
+            b->name = xstrdup(w[0]);
+            if (n < 2)
+                die("button %s has no code", w[0]);
+            b->value = number(w[1]);
+            continue;
+        }
+
+        if (n == 2 && !strcmp(w[0], "begin")) {
+            if (!strcmp(w[1], "codes"))
+                in_codes = 1;
+            else if (!strcmp(w[1], "raw_codes"))
+                r->bad_flag = "raw_codes";
+            continue;
+        }
+
+        if (!strcmp(w[0], "name") && n >= 2)
+            r->name = xstrdup(w[1]);
+        else if (!strcmp(w[0], "bits") && n >= 2)
+            r->bits = number(w[1]);
+        else if (!strcmp(w[0], "pre_data_bits") && n >= 2)
+            r->pre_data_bits = number(w[1]);
+        else if (!strcmp(w[0], "pre_data") && n >= 2)
+            r->pre_data = number(w[1]);
+        else if (!strcmp(w[0], "post_data_bits") && n >= 2)
+            r->post_data_bits = number(w[1]);
+        else if (!strcmp(w[0], "post_data") && n >= 2)
+            r->post_data = number(w[1]);
+        else if (!strcmp(w[0], "toggle_bit_mask") && n >= 2)
+            r->toggle_bit_mask = number(w[1]);
+        else if (!strcmp(w[0], "flags") && n >= 2) {
+            static const char *bad[] = {
+                "RCMM", "SHIFT_ENC", "REVERSE", "GOLDSTAR",
+                "GRUNDIG", "BO", "SERIAL", "XMP", "RAW_CODES", NULL
+            };
+            const char **fl;
+
+            for (p = strtok(w[1], "|"); p; p = strtok(NULL, "|"))
+                for (fl = bad; *fl; fl++)
+                    if (!strcmp(p, *fl))
+                        r->bad_flag = xstrdup(p);
+        }
+    }
+    if (r)
+        die("no \"end remote\"");
+
+    fclose(f);
+    fname = NULL;
+}
+
+static struct remote *find_remote(const char *name)
+{
+    int i;
+
+    for (i = 0; i < nremotes; i++)
+        if (!strcmp(remotes[i].name, name))
+            return &remotes[i];
+    return NULL;
+}
+
+// what ir.c will report for this button
+static uint32_t received_code(struct remote *r, struct button *b)
+{
+    unsigned long long v;
+    int bits;
+
+    bits = r->pre_data_bits + r->bits + r->post_data_bits;
+    if (bits > 63)
+        die("%s: %d bits is too many", r->name, bits);
+    if (bits < 4)
+        die("%s: %d bits is too few", r->name, bits);
+
+    v = r->pre_data;
+    v = (v << r->bits) | b->value;
+    v = (v << r->post_data_bits) | r->post_data;
+    v &= ~r->toggle_bit_mask;
+
+    if (bits > IR_MAX_BITS)
+        v >>= bits - IR_MAX_BITS;
+
+    return (uint32_t)v;
+}
+
+static void read_map(const char *file)
+{
+    FILE *f;
+    char line[256], *w[4];
+    struct remote *r;
+    struct code *c;
+    const char **cmd;
+    int i, n;
+
+    f = fopen(file, "r");
+    if (!f) {
+        perror(file);
+        exit(1);
+    }
+    fname = file;
+    lineno = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        n = words(line, w, 4);
+        if (!n)
+            continue;
+        if (n != 3)
+            die("expected \"remote button command\"");
+
+        r = find_remote(w[0]);
+        if (!r)
+            die("no remote named %s", w[0]);
+        if (r->bad_flag)
+            die("%s (%s) uses %s, which ir.c can't decode",
+                    r->name, r->file, r->bad_flag);
+        for (i = 0; i < r->nbuttons; i++)
+            if (!strcmp(r->buttons[i].name, w[1]))
+                break;
+        if (i == r->nbuttons)
+            die("%s has no button named %s", r->name, w[1]);
+        for (cmd = commands; *cmd; cmd++)
+            if (!strcmp(*cmd, w[2]))
+                break;
+        if (!*cmd)
+            die("unknown command %s", w[2]);
+
+        if (ncodes == MAX_CODES)
+            die("too many buttons");
+        c = &codes[ncodes];
+        c->code = received_code(r, &r->buttons[i]);
+        c->cmd = *cmd;
+        c->remote = r->name;
+        c->button = r->buttons[i].name;
+
+        for (i = 0; i < ncodes; i++) {
+            if (codes[i].code != c->code)
+                continue;
+            if (codes[i].cmd != c->cmd)
+                die("%s %s sends the same code as %s %s",
+                    c->remote, c->button, codes[i].remote, codes[i].button);
+            break;
+        }
+        if (i == ncodes)        // not a harmless duplicate
+            ncodes++;
+    }
+
+    fclose(f);
+    fname = NULL;
+
+    if (!ncodes)
+        die("%s maps no buttons", file);
+}
+
+static int bucket_size(int b)
+{
+    int i, n = 0;
+
+    for (i = 0; i < ncodes; i++)
+        if (ir_hash_bucket(codes[i].hash, nbuckets) == b)
+            n++;
+    return n;
+}
+
+// place one bucket's codes, if some displacement lets them all fit
+static int place_bucket(int b)
+{
+    struct code *c[MAX_CODES];
+    int i, j, k, n = 0, d;
+    uint8_t s;
+
+    for (i = 0; i < ncodes; i++)
+        if (ir_hash_bucket(codes[i].hash, nbuckets) == b)
+            c[n++] = &codes[i];
+
+    for (d = 0; d < 256; d++) {
+        for (i = 0; i < n; i++) {
+            s = ir_hash_slot(c[i]->hash, d, ncodes);
+            if (table[s])
+                break;
+            for (j = 0; j < i; j++)
+                if (ir_hash_slot(c[j]->hash, d, ncodes) == s)
+                    break;
+            if (j < i)
+                break;
+        }
+        if (i == n) {
+            for (k = 0; k < n; k++)
+                table[ir_hash_slot(c[k]->hash, d, ncodes)] = c[k];
+            disp[b] = d;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// try seeds until every bucket, biggest first, can be placed
+static void build_table(void)
+{
+    int order[MAX_CODES], size[MAX_CODES];
+    int i, j, t, s;
+
+    for (nbuckets = 1; nbuckets * 2 < ncodes; nbuckets *= 2)
+        continue;
+
+    for (s = 0; s < 0x10000; s++) {
+        seed = s;
+        for (i = 0; i < ncodes; i++)
+            codes[i].hash = ir_hash(codes[i].code, seed);
+        for (i = 0; i < nbuckets; i++) {
+            order[i] = i;
+            size[i] = bucket_size(i);
+        }
+        for (i = 1; i < nbuckets; i++) {
+            for (j = i; j > 0 && size[order[j]] > size[order[j - 1]]; j--) {
+                t = order[j];
+                order[j] = order[j - 1];
+                order[j - 1] = t;
+            }
+        }
+
+        memset(table, 0, sizeof(table));
+        memset(disp, 0, sizeof(disp));
+        for (i = 0; i < nbuckets; i++)
+            if (!place_bucket(order[i]))
+                break;
+        if (i == nbuckets)
+            return;
+    }
+    die("no perfect hash found for %d codes", ncodes);
+}
+
+static void write_table(int argc, char **argv)
+{
+    int i;
+
+    printf("/*\n * generated by host/irtable, from");
+    for (i = 0; i < argc; i++)
+        printf(" %s", argv[i]);
+    printf(".\n * don't edit.  see irhash.h.\n */\n\n");
+
+    printf("#define IR_HASH_SEED    0x%04x\n", seed);
+    printf("#define IR_HASH_BUCKETS %d\n", nbuckets);
+    printf("#define IR_TABLE_SIZE   %d\n\n", ncodes);
+
+    printf("static const byte ir_hash_disp[IR_HASH_BUCKETS] PROGMEM = {");
+    for (i = 0; i < nbuckets; i++)
+        printf("%s%d,", i % 12 ? " " : "\n    ", disp[i]);
+    printf("\n};\n\n");
+
+    printf("static const struct irc ir_remote_codes[IR_TABLE_SIZE] "
+            "PROGMEM = {\n");
+    for (i = 0; i < ncodes; i++) {
+        char cmd[16], *p;
+
+        strcpy(cmd, table[i]->cmd);
+        for (p = cmd; *p; p++)
+            *p = toupper(*p);
+        printf("    { 0x%08lx, IR_%-6s },  // %s %s\n",
+            (unsigned long)table[i]->code, cmd,
+            table[i]->remote, table[i]->button);
+    }
+    printf("};\n");
+}
+
+
+/*
+ * the benchmark.  both lookups use the same arrays, so only the
+ * search differs.  the linear scan goes in the map's order.  the firmware's cost is in pgm_read_dword()s and
+ * 32 bit compares, which are counted; the host times are just a
+ * rough check.
+ */
+static volatile uint32_t sink;
+
+static int linear_lookup(uint32_t code, int *compares)
+{
+    int i;
+
+    for (i = 0; i < ncodes; i++) {
+        (*compares)++;
+        if (codes[i].code == code)
+            return i;
+    }
+    return -1;
+}
+
+static int hash_lookup(uint32_t code, int *compares)
+{
+    uint16_t h;
+    uint8_t s;
+
+    h = ir_hash(code, seed);
+    s = ir_hash_slot(h, disp[ir_hash_bucket(h, nbuckets)], ncodes);
+    (*compares)++;
+    return table[s]->code == code ? s : -1;
+}
+
+static double time_lookups(int (*lookup)(uint32_t, int *), uint32_t *keys,
+                int nkeys, int *compares)
+{
+    struct timespec t0, t1;
+    int i, rounds = 200000, n = 0;
+
+    *compares = 0;
+    for (i = 0; i < nkeys; i++)
+        lookup(keys[i], compares);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < rounds; i++)
+        sink += lookup(keys[i % nkeys], &n);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec))
+            / rounds;
+}
+
+static void benchmark(void)
+{
+    uint32_t hits[MAX_CODES], misses[MAX_CODES];
+    int i, lc, hc;
+    double lt, ht;
+
+    for (i = 0; i < ncodes; i++) {
+        hits[i] = codes[i].code;
+        misses[i] = codes[i].code ^ 0x00010000;     // a neighbor's
+    }
+
+    printf("%d codes, %d buckets, seed 0x%04x\n", ncodes, nbuckets, seed);
+    printf("%-8s %12s %12s %12s %12s\n", "",
+            "hit cmp", "hit ns", "miss cmp", "miss ns");
+
+    lt = time_lookups(linear_lookup, hits, ncodes, &lc);
+    printf("%-8s %12.1f %12.1f", "linear", (double)lc / ncodes, lt);
+    lt = time_lookups(linear_lookup, misses, ncodes, &lc);
+    printf(" %12.1f %12.1f\n", (double)lc / ncodes, lt);
+
+    ht = time_lookups(hash_lookup, hits, ncodes, &hc);
+    printf("%-8s %12.1f %12.1f", "hash", (double)hc / ncodes, ht);
+    ht = time_lookups(hash_lookup, misses, ncodes, &hc);
+    printf(" %12.1f %12.1f\n", (double)hc / ncodes, ht);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "usage: %s [-b] map-file lircd.conf ...\n"
+        "   -b  compare lookup costs, instead of writing the table\n",
+        prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int c, bench = 0, i;
+
+    while ((c = getopt(argc, argv, "b")) != -1) {
+        switch (c) {
+        case 'b': bench = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (argc - optind < 2)
+        usage(argv[0]);
+
+    for (i = optind + 1; i < argc; i++)
+        read_conf(argv[i]);
+    read_map(argv[optind]);
+    build_table();
+
+    if (bench)
+        benchmark();
+    else
+        write_table(argc - optind, argv + optind);
+
+    return 0;
+}
+
+// vile:noti:sw=4
@@ -0,0 +1,1485 @@
+/*
+ * Copyright (c) 2013 Paul Fox, pgf@foxharp.boston.ma.us
+ *
+ * Licensed under GPL version 2, see accompanying LICENSE file
+ * for details.
+ */
+
+/*
+ * sim.c - run the blind controller firmware on linux.
+ *
+ * the firmware is compiled for the host against host/sim.h, which
+ * provides the attiny861 registers it uses.  this file models the
+ * parts of the chip behind them (the two timers, the external and
+ * pin change interrupts, the watchdog, and the eeprom), plus the
+ * world outside it:  a motor with its rotation sensor, the IR
+ * receiver, the pushbutton, and the serial line.
+ *
+ * the inputs come from a scenario file, one timed action per line:
+ *
+ *      # comment
+ *      <ms> <action> [args]        absolute time
+ *      +<ms> <action> [args]       relative to the previous line
+ *
+ *   serial <text>          type text (C escapes ok), then a CR
+ *   serialraw <text>       type text, with no CR
+ *   ir nec|samsung <code> [count]      32 bit frame(s), msb first
+ *   ir sony <nbits> <code> [count]     sony frame(s), msb first
+ *   irrepeat <count>       NEC "repeat" frames
+ *   irraw <usec> ...       raw mark/space durations, mark first
+ *   button <ms>            hold the button down
+ *   pulse [count]          rotation pulses, as if from the motor
+ *   motor <rev/s> <spinup ms> <coast rev/s/s> <brake rev/s/s>
+ *   limit <revs>           top limit switch position
+ *   jam <ms>               hold the spool still
+ *   powerfail <ms>         the supply fails, and is gone <ms> later
+ *   powerdip <ms>          the supply sags for a while
+ *   cost <usec>            simulated cost of one main loop pass
+ *   expect <text>          the serial output since the last check
+ *                          (at an earlier time) should include
+ *                          text (C escapes ok)...
+ *   expectnot <text>       ...or shouldn't
+ *   expectruns <task> <n>  the named main loop task should have run
+ *                          at most n times since the last such check.
+ *                          "sleep" counts the main loop's sleeps.
+ *   end                    stop the simulation
+ *
+ * the motor, limit, and cost settings take effect immediately,
+ * rather than at their time.
+ *
+ * the firmware's serial output is decoded from the timer1 output
+ * compare pin, and copied to stdout.  a report (lines starting
+ * with '#') follows when the simulation ends.  failed checks are
+ * reported on stderr, and make the exit status 3.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim.h"
+
+extern int firmware_main(void);
+
+/* registers */
+volatile uint8_t SREG;
+volatile uint8_t PORTA, PORTB, DDRA, DDRB;
+volatile uint8_t MCUCR, MCUSR, GIMSK, PCMSK0, PCMSK1;
+volatile uint8_t TCCR0A, TCCR0B, TCNT0H, OCR0A, OCR0B;
+volatile uint8_t TCCR1A, TCCR1B, TC1H, TIMSK;
+volatile uint8_t CLKPR;
+volatile uint8_t ADMUX, ADCSRA, DIDR0;
+volatile uint8_t EECR;
+volatile uint16_t EEAR;
+volatile uint16_t OCR1A, OCR1B, OCR1C, OCR1D;
+
+uint8_t sim_sram[512];
+uint8_t sim_flash[8192];
+
+/*
+ * interrupt flags.  the firmware clears them by writing ones.
+ * each register's visible copy carries a bit that the firmware
+ * never writes, so we can tell when it has been written.
+ */
+#define FLAG_SENTINEL 0x8000
+static uint8_t tifr_flags, gifr_flags;
+static volatile uint16_t tifr_reg = FLAG_SENTINEL;
+static volatile uint16_t gifr_reg = FLAG_SENTINEL;
+
+// the analog comparator's register mixes control bits, the
+// output, and the flag
+static uint8_t acsra_ctl, acsra_flags, ac_out;
+static volatile uint16_t acsra_reg = FLAG_SENTINEL;
+
+static volatile uint8_t pin_reg[2];
+static volatile uint8_t tcnt0l_reg;
+
+/*
+ * the outside world's drive on the input pins, idle high.  the
+ * third "port" isn't wired to anything:  it holds other timed
+ * changes to the world, so they can be scheduled like pin changes.
+ */
+#define WORLD       2
+#define W_JAMMED    _BV(0)      // something is holding the spool
+#define W_POWER_LOW _BV(1)      // the supply is failing
+#define W_POWER_OFF _BV(2)      // ...and now it's gone
+static uint8_t ext[3] = { 0xff, 0xff, 0 };
+
+// not a port either:  an event for this checks the output
+#define CHECK       3
+
+static uint64_t now;        // simulated microseconds
+static uint64_t end_time;
+static long pass_cost = 10; // simulated usec per main loop pass
+
+static int quiet, tstamps;
+
+/*
+ * interrupt vectors, in priority order.  the firmware defines
+ * the ones it uses.
+ */
+#define VECTOR(v) void v(void) __attribute__((weak))
+VECTOR(INT0_vect);
+VECTOR(PCINT_vect);
+VECTOR(TIMER1_COMPA_vect);
+VECTOR(TIMER1_COMPB_vect);
+VECTOR(TIMER0_OVF_vect);
+VECTOR(EE_RDY_vect);
+VECTOR(ANA_COMP_vect);
+VECTOR(INT1_vect);
+VECTOR(TIMER0_CAPT_vect);
+VECTOR(TIMER1_COMPD_vect);
+
+enum { F_TIFR, F_GIFR, F_EECR, F_ACSRA };
+
+static struct vector {
+    const char *name;
+    void (*func)(void);
+    uint8_t flagreg, flag;
+    uint8_t mask;           // in TIMSK, GIMSK, EECR, or ACSRA
+    uint8_t noblock;
+    unsigned long count;
+    double ns, max_ns;
+} vectors[] = {
+    { "INT0",       INT0_vect,          F_GIFR, _BV(INTF0), _BV(INT0) },
+    { "PCINT",      PCINT_vect,         F_GIFR, _BV(PCIF),
+                                        _BV(PCIE0) | _BV(PCIE1) },
+    { "T1_COMPA",   TIMER1_COMPA_vect,  F_TIFR, _BV(OCF1A), _BV(OCIE1A), 1 },
+    { "T1_COMPB",   TIMER1_COMPB_vect,  F_TIFR, _BV(OCF1B), _BV(OCIE1B) },
+    { "T0_OVF",     TIMER0_OVF_vect,    F_TIFR, _BV(TOV0), _BV(TOIE0) },
+    { "EE_RDY",     EE_RDY_vect,        F_EECR, 1, _BV(EERIE) },
+    { "ANA_COMP",   ANA_COMP_vect,      F_ACSRA, _BV(ACI), _BV(ACIE) },
+    { "INT1",       INT1_vect,          F_GIFR, _BV(INTF1), _BV(INT1) },
+    { "T0_CAPT",    TIMER0_CAPT_vect,   F_TIFR, _BV(ICF0), _BV(TICIE0) },
+    { "T1_COMPD",   TIMER1_COMPD_vect,  F_TIFR, _BV(OCF1D), _BV(OCIE1D) },
+};
+#define NVECTORS (sizeof(vectors) / sizeof(vectors[0]))
+
+static int isr_depth;
+
+/* main loop accounting */
+static struct task_stats {
+    void (*func)(void);
+    const char *name;
+    unsigned long count;
+    unsigned long checked;  // count, at the last expectruns
+    double ns, max_ns;
+    uint64_t max_us;        // simulated time, spent busy-waiting
+} tasks[8];
+static struct timespec task_start;
+static uint64_t task_start_us;
+static unsigned long passes, sleeps;
+static uint64_t slept_usec;
+static double host_start, fw_ns;
+
+/* the world outside */
+static struct motor {
+    double vmax;            // rev/s
+    double tau;             // spin-up time constant, seconds
+    double coast, brake;    // deceleration, rev/s/s
+    double v;
+    double phase;           // revs since the magnet passed the sensor
+    double position;        // revs, positive in the DIR=1 direction
+    int dir;                // +1 or -1, as last driven
+    double limit;           // top limit switch position, if any
+    int have_limit;
+    unsigned long starts, pulses;
+    double on_secs, vpeak;
+    uint64_t pulse_end;
+    uint64_t last_pulse;    // when the last rotation pulse began
+    unsigned long stops;    // power removed while turning, and how
+    uint64_t stop_lag, stop_lag_max;    // long after the last pulse
+} motor = {
+    .vmax = 8, .tau = 0.15, .coast = 25, .brake = 80, .dir = 1,
+};
+
+static unsigned long ir_frames, ir_codes, serial_sent, serial_rcvd;
+
+// when each IR frame sent ends, to time how soon the motor starts
+#define IR_ENDS 256
+static uint64_t ir_ends[IR_ENDS];
+static unsigned ir_nends;
+static unsigned long ir_reacts;
+static uint64_t ir_react, ir_react_max;
+static unsigned long eeprom_writes;
+static unsigned long eeprom_wear[512];      // writes to each byte
+
+static const char *eeprom_file;
+static uint8_t eeprom[512];
+static uint8_t eedr_reg;
+static uint64_t ee_done;        // when the write in progress finishes
+static uint16_t ee_addr;
+static uint8_t ee_data;
+#define EEPROM_WRITE_US 3400
+
+static void finish(const char *why, int status);
+static void ee_update(void);
+
+static double host_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/*
+ * scheduled changes to the input pins
+ */
+struct event {
+    uint64_t when;
+    unsigned long seq;      // keeps simultaneous events in order
+    uint8_t port, bits, level;
+};
+
+static struct event *events;
+static size_t nevents, maxevents;
+static unsigned long event_seq;
+
+static int event_before(struct event *a, struct event *b)
+{
+    if (a->when != b->when)
+        return a->when < b->when;
+    return a->seq < b->seq;
+}
+
+static void schedule(uint64_t when, int port, uint8_t bits, int level)
+{
+    struct event e, t;
+    size_t i;
+
+    if (nevents == maxevents) {
+        maxevents = maxevents ? maxevents * 2 : 256;
+        events = realloc(events, maxevents * sizeof(*events));
+        if (!events) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+
+    e.when = when;
+    e.seq = event_seq++;
+    e.port = port;
+    e.bits = bits;
+    e.level = level;
+
+    // a binary heap, earliest first
+    i = nevents++;
+    events[i] = e;
+    while (i && event_before(&events[i], &events[(i - 1) / 2])) {
+        t = events[i];
+        events[i] = events[(i - 1) / 2];
+        events[(i - 1) / 2] = t;
+        i = (i - 1) / 2;
+    }
+}
+
+static void unschedule_first(void)
+{
+    struct event t;
+    size_t i, c;
+
+    events[0] = events[--nevents];
+    i = 0;
+    for (;;) {
+        c = 2 * i + 1;
+        if (c >= nevents)
+            break;
+        if (c + 1 < nevents && event_before(&events[c + 1], &events[c]))
+            c++;
+        if (!event_before(&events[c], &events[i]))
+            break;
+        t = events[i];
+        events[i] = events[c];
+        events[c] = t;
+        i = c;
+    }
+}
+
+
+/*
+ * registers with side effects
+ */
+static uint8_t pin_value(int port)
+{
+    uint8_t port_reg = port ? PORTB : PORTA;
+    uint8_t ddr = port ? DDRB : DDRA;
+
+    return (port_reg & ddr) | (ext[port] & ~ddr);
+}
+
+volatile uint8_t *sim_pin(int port)
+{
+    pin_reg[port] = pin_value(port);
+    return &pin_reg[port];
+}
+
+void sim_pin_toggle(volatile uint8_t *pin, uint8_t mask)
+{
+    if (pin == &pin_reg[0])
+        PORTA ^= mask;
+    else
+        PORTB ^= mask;
+}
+
+static void flags_mirror(void)
+{
+    tifr_reg = tifr_flags | FLAG_SENTINEL;
+    gifr_reg = gifr_flags | FLAG_SENTINEL;
+    acsra_reg = acsra_ctl | ac_out | acsra_flags | FLAG_SENTINEL;
+}
+
+// apply any flag clearing the firmware has done
+static void flags_sync(void)
+{
+    if (tifr_reg != (tifr_flags | FLAG_SENTINEL))
+        tifr_flags &= ~tifr_reg;
+    if (gifr_reg != (gifr_flags | FLAG_SENTINEL))
+        gifr_flags &= ~gifr_reg;
+    if (acsra_reg != (acsra_ctl | ac_out | acsra_flags | FLAG_SENTINEL)) {
+        acsra_ctl = acsra_reg & ~(_BV(ACO) | _BV(ACI) | FLAG_SENTINEL);
+        acsra_flags &= ~acsra_reg;
+    }
+    flags_mirror();
+}
+
+static void flag_set(int reg, uint8_t flag)
+{
+    flags_sync();
+    if (reg == F_TIFR)
+        tifr_flags |= flag;
+    else
+        gifr_flags |= flag;
+    flags_mirror();
+}
+
+volatile uint16_t *sim_tifr(void)
+{
+    flags_sync();
+    return &tifr_reg;
+}
+
+volatile uint16_t *sim_gifr(void)
+{
+    flags_sync();
+    return &gifr_reg;
+}
+
+volatile uint16_t *sim_acsra(void)
+{
+    flags_sync();
+    return &acsra_reg;
+}
+
+/*
+ * the analog comparator, set up as the firmware's power failure
+ * detector:  the bandgap against ADC6, through the ADC multiplexer.
+ * the output is high while the supply is failing.
+ */
+static void comparator_update(void)
+{
+    uint8_t out;
+
+    flags_sync();
+    out = !(acsra_ctl & _BV(ACD)) && (acsra_ctl & _BV(ACBG)) &&
+        (acsra_ctl & _BV(ACME)) && !(ADCSRA & _BV(ADEN)) &&
+        (ADMUX & 0x1f) == 6 && (ext[WORLD] & W_POWER_LOW);
+    out = out ? _BV(ACO) : 0;
+    if (out != ac_out) {
+        switch (acsra_ctl & (_BV(ACIS1) | _BV(ACIS0))) {
+        case 0:                                 // toggle
+            acsra_flags |= _BV(ACI);
+            break;
+        case _BV(ACIS1):                        // falling
+            if (!out)
+                acsra_flags |= _BV(ACI);
+            break;
+        case _BV(ACIS1) | _BV(ACIS0):           // rising
+            if (out)
+                acsra_flags |= _BV(ACI);
+            break;
+        }
+        ac_out = out;
+    }
+    flags_mirror();
+}
+
+volatile uint8_t *sim_tcnt0l(void)
+{
+    uint16_t t0 = now & 0xffff;
+
+    TCNT0H = t0 >> 8;
+    tcnt0l_reg = t0 & 0xff;
+    return &tcnt0l_reg;
+}
+
+unsigned int sim_tcnt1(void)
+{
+    return now % ((unsigned)OCR1C + 1);
+}
+
+
+/*
+ * interrupts
+ */
+static int dispatch(void)
+{
+    struct vector *v;
+    uint8_t *flags, enable, ee_flags;
+    double t0, t;
+    int ran = 0;
+
+    for (;;) {
+        if (!(SREG & _BV(SREG_I)))
+            return ran;
+
+        flags_sync();
+        // EE_RDY has no flag:  it's asserted whenever the eeprom is idle
+        ee_flags = !(EECR & _BV(EEPE));
+        for (v = vectors; v < &vectors[NVECTORS]; v++) {
+            switch (v->flagreg) {
+            case F_TIFR:
+                flags = &tifr_flags;
+                enable = TIMSK;
+                break;
+            case F_GIFR:
+                flags = &gifr_flags;
+                enable = GIMSK;
+                break;
+            case F_EECR:
+                flags = &ee_flags;
+                enable = EECR;
+                break;
+            default:
+                flags = &acsra_flags;
+                enable = acsra_ctl;
+                break;
+            }
+            if ((*flags & v->flag) && (enable & v->mask) && v->func)
+                break;
+        }
+        if (v == &vectors[NVECTORS])
+            return ran;
+
+        // entering the handler clears its flag, and interrupts
+        *flags &= ~v->flag;
+        flags_mirror();
+        SREG &= ~_BV(SREG_I);
+        if (v->noblock)
+            SREG |= _BV(SREG_I);
+
+        isr_depth++;
+        t0 = host_ns();
+        v->func();
+        t = host_ns() - t0;
+        isr_depth--;
+
+        v->count++;
+        v->ns += t;
+        if (t > v->max_ns)
+            v->max_ns = t;
+        ran = 1;
+
+        SREG |= _BV(SREG_I);    // reti
+    }
+}
+
+static int sleep_enabled, sleep_mode;
+
+void sim_sei(void)
+{
+    SREG |= _BV(SREG_I);
+
+    // as on the real chip, "sei(); sleep_cpu();" can't lose a
+    // wakeup:  the interrupt is taken by the sleep instruction.
+    if (sleep_enabled && !isr_depth)
+        return;
+    dispatch();
+}
+
+
+/*
+ * the motor, and the rotation sensor on PA2 (INT1).  the sensor
+ * is low for a couple of milliseconds once per revolution.
+ */
+#define ROTATION_PULSE_US 2000
+
+// the motor started.  if an IR frame just ended, that's why.
+static void ir_reaction(void)
+{
+    uint64_t end = 0;
+    unsigned i;
+
+    for (i = 0; i < ir_nends; i++)
+        if (ir_ends[i] <= now && ir_ends[i] > end)
+            end = ir_ends[i];
+    if (!end || now - end > 500000)
+        return;
+
+    ir_reacts++;
+    ir_react += now - end;
+    if (now - end > ir_react_max)
+        ir_react_max = now - end;
+}
+
+static void motor_update(double dt)
+{
+    int on = (PORTA & DDRA) & _BV(PA0) && !(ext[WORLD] & W_POWER_LOW);
+    int dir = (PORTA & _BV(PA1)) ? 1 : -1;
+    double v0 = motor.v;
+    static int was_on;
+
+    if (on && !was_on) {
+        motor.starts++;
+        ir_reaction();
+    }
+    if (!on && was_on && motor.v > 0) {
+        uint64_t lag = now - motor.last_pulse;
+
+        motor.stops++;
+        motor.stop_lag += lag;
+        if (lag > motor.stop_lag_max)
+            motor.stop_lag_max = lag;
+    }
+    was_on = on;
+
+    if (ext[WORLD] & W_JAMMED) {
+        motor.v = 0;
+        if (on)
+            motor.on_secs += dt;
+    } else if (on) {
+        if (motor.v == 0 && dir != motor.dir) {
+            // the magnet is at a fixed place on the spool, so
+            // going back, it's that far to the sensor again
+            motor.dir = dir;
+            motor.phase = 1 - motor.phase;
+        }
+        if (dir == motor.dir)   // spin up toward full speed
+            motor.v += (motor.vmax - motor.v) * (1 - exp(-dt / motor.tau));
+        else                    // plugged:  stop, then reverse
+            motor.v -= motor.brake * dt;
+        motor.on_secs += dt;
+    } else {
+        // with power removed, the direction relay either lets
+        // the motor coast, or, when reversed, shorts it.
+        motor.v -= (dir == motor.dir ? motor.coast : motor.brake) * dt;
+    }
+    if (motor.v < 0)
+        motor.v = 0;
+    if (motor.v > motor.vpeak)
+        motor.vpeak = motor.v;
+
+    motor.phase += (v0 + motor.v) / 2 * dt;
+    motor.position += motor.dir * (v0 + motor.v) / 2 * dt;
+}
+
+// when the next rotation pulse will start, if nothing changes
+static uint64_t motor_next_pulse(void)
+{
+    int on = (PORTA & DDRA) & _BV(PA0);
+    double us;
+
+    if (motor.v <= 0)
+        return on ? now + 1000 : UINT64_MAX;
+
+    us = (1 - motor.phase) / motor.v * 1e6;
+    if (us > 1000)      // reconsider the speed every millisecond
+        us = 1000;
+    return now + (us < 1 ? 1 : (uint64_t)us);
+}
+
+static void motor_pulse(void)
+{
+    if (motor.phase < 1)
+        return;
+    motor.phase -= 1;
+    motor.pulses++;
+    motor.last_pulse = now;
+    schedule(now, 0, _BV(PA2), 0);
+    schedule(now + ROTATION_PULSE_US, 0, _BV(PA2), 1);
+}
+
+static void limit_update(void)
+{
+    if (!motor.have_limit)
+        return;
+    if (motor.position >= motor.limit)
+        ext[0] &= ~_BV(PA3);
+    else
+        ext[0] |= _BV(PA3);
+}
+
+
+/*
+ * the serial line, out of the chip.  timer1 compare A sets the
+ * TX pin as the firmware asks, once per bit time, so we decode
+ * one bit per compare match.
+ */
+static int tx_level = 1, tx_bit = -1, tx_data;
+static int tx_bol = 1;
+
+// the output since the last check, for the checks
+#define SEEN_MAX 8192
+static char seen[SEEN_MAX + 1];
+static size_t nseen;
+static int seen_checked;    // start afresh with the next character
+
+static struct check {
+    char *text;
+    int not;
+    long runs;              // expectruns:  the most allowed, else -1
+    int line;
+} checks[256];
+static int nchecks, checks_failed;
+static const char *scenario;
+
+static void check_output(int i)
+{
+    struct check *c = &checks[i];
+    struct task_stats *ts;
+    unsigned long n;
+
+    if (c->runs >= 0) {
+        static unsigned long sleeps_checked;
+
+        n = 0;
+        if (!strcmp(c->text, "sleep")) {
+            n = sleeps - sleeps_checked;
+            sleeps_checked = sleeps;
+        }
+        for (ts = tasks; ts < &tasks[8] && ts->func; ts++) {
+            if (!strcmp(ts->name, c->text)) {
+                n = ts->count - ts->checked;
+                ts->checked = ts->count;
+            }
+        }
+        if (n > (unsigned long)c->runs) {
+            fflush(stdout);
+            fprintf(stderr, "%s:%d: at %.3f sec, %s ran %lu times\n",
+                    scenario, c->line, now / 1e6, c->text, n);
+            checks_failed++;
+        }
+        return;
+    }
+
+    seen[nseen] = '\0';
+    if (!strstr(seen, c->text) == !c->not) {
+        fflush(stdout);
+        fprintf(stderr, "%s:%d: at %.3f sec, output %s \"%s\"\n",
+                scenario, c->line, now / 1e6,
+                c->not ? "includes" : "lacks", c->text);
+        checks_failed++;
+    }
+    seen_checked = 1;
+}
+
+static void tx_char(int c)
+{
+    static const char marker[] = "ir_code = 0x";
+    static unsigned matched;
+
+    if (c == '\r')
+        return;
+
+    if (tx_bol && tstamps && !quiet)
+        printf("[%10.6f] ", now / 1e6);
+    tx_bol = (c == '\n');
+    if (!quiet)
+        putchar(c);
+
+    if (seen_checked) {
+        nseen = 0;
+        seen_checked = 0;
+    }
+    if (nseen == SEEN_MAX) {    // keep the newer half
+        memmove(seen, seen + SEEN_MAX / 2, SEEN_MAX / 2);
+        nseen = SEEN_MAX / 2;
+    }
+    seen[nseen++] = c;
+
+    // count the IR codes the firmware reports.  the marker has no
+    // repeated prefix, so this simple matcher is enough.
+    if (c == marker[matched])
+        matched++;
+    else
+        matched = (c == marker[0]);
+    if (!marker[matched]) {
+        ir_codes++;
+        matched = 0;
+    }
+
+    serial_rcvd++;
+}
+
+static void tx_sample(void)
+{
+    if (!(DDRB & _BV(PB1)))
+        return;
+
+    if (TCCR1A & _BV(COM1A1))
+        tx_level = !!(TCCR1A & _BV(COM1A0));
+
+    if (tx_bit < 0) {
+        if (!tx_level) {        // start bit
+            tx_bit = 0;
+            tx_data = 0;
+        }
+    } else if (tx_bit < 8) {
+        tx_data |= tx_level << tx_bit;
+        tx_bit++;
+    } else {
+        if (tx_level)
+            tx_char(tx_data);
+        else if (!quiet)
+            printf("<framing error>");
+        tx_bit = -1;
+    }
+}
+
+
+/*
+ * an input pin has changed.  work out which interrupt flags that
+ * sets, as the edge detectors and input capture unit would.
+ */
+static void pin_changed(int port, uint8_t was, uint8_t is)
+{
+    uint8_t changed = was ^ is;
+    uint8_t fell = changed & was;
+    uint8_t rose = changed & is;
+    uint8_t isc = MCUCR & (_BV(ISC01) | _BV(ISC00));
+    uint8_t edges;
+
+    // INT0 and INT1 share their sense control on the tiny861
+    switch (isc) {
+    case 0:  // low level:  close enough
+    case _BV(ISC01): edges = fell; break;
+    case _BV(ISC00): edges = changed; break;
+    default: edges = rose; break;
+    }
+
+    if (port == 0) {
+        if (edges & _BV(PA2))
+            flag_set(F_GIFR, _BV(INTF1));
+
+        if ((TCCR0A & _BV(ICEN0)) && (changed & _BV(PA4))) {
+            if (((TCCR0A & _BV(ICES0)) ? rose : fell) & _BV(PA4)) {
+                uint16_t t0 = now & 0xffff;
+                OCR0A = t0 & 0xff;
+                OCR0B = t0 >> 8;
+                flag_set(F_TIFR, _BV(ICF0));
+            }
+        }
+        // PCINT0-7 are enabled by PCIE1
+        if ((changed & PCMSK0) && (GIMSK & _BV(PCIE1)))
+            flag_set(F_GIFR, _BV(PCIF));
+    } else {
+        if (edges & _BV(PB6))
+            flag_set(F_GIFR, _BV(INTF0));
+
+        // PCINT8-11 are enabled by PCIE0, and PCINT12-15 by PCIE1
+        if ((changed & PCMSK1 & 0x0f) && (GIMSK & _BV(PCIE0)))
+            flag_set(F_GIFR, _BV(PCIF));
+        if ((changed & PCMSK1 & 0xf0) && (GIMSK & _BV(PCIE1)))
+            flag_set(F_GIFR, _BV(PCIF));
+    }
+}
+
+
+/*
+ * the watchdog
+ */
+static uint64_t wdt_period, wdt_deadline;
+
+void wdt_enable(uint8_t timeout)
+{
+    wdt_period = 16000ULL << timeout;
+    wdt_deadline = now + wdt_period;
+}
+
+void wdt_disable(void)
+{
+    wdt_period = 0;
+}
+
+
+/*
+ * advance time to the next thing that happens, but no further
+ * than "limit".  returns true if an interrupt handler ran.
+ */
+static uint64_t next_match(uint16_t ocr)
+{
+    unsigned top = (unsigned)OCR1C + 1;
+    uint64_t t = sim_tcnt1();
+
+    return now + (ocr + top - t - 1) % top + 1;
+}
+
+static int step(uint64_t limit)
+{
+    uint64_t next = limit;
+    uint64_t ma, mb, md, mo, mp;
+    uint8_t was[2];
+    int port;
+
+    ma = next_match(OCR1A & 0x3ff);
+    mb = next_match(OCR1B & 0x3ff);
+    md = next_match(OCR1D & 0x3ff);
+    mo = (now | 0xffff) + 1;
+    mp = motor_next_pulse();
+
+    if (ma < next) next = ma;
+    if (mb < next) next = mb;
+    if (md < next) next = md;
+    if (mo < next) next = mo;
+    if (mp < next) next = mp;
+    if (nevents && events[0].when < next)
+        next = events[0].when;
+    ee_update();
+    if (ee_done && ee_done < next)
+        next = ee_done;
+    if (wdt_period && wdt_deadline < next)
+        next = wdt_deadline;
+    if (end_time < next)
+        next = end_time;
+    if (next < now)
+        next = now;
+
+    motor_update((next - now) / 1e6);
+    now = next;
+
+    if (now >= end_time)
+        finish("end of scenario", 0);
+    if (wdt_period && now >= wdt_deadline)
+        finish("watchdog reset", 2);
+
+    if (now == ma) {
+        flag_set(F_TIFR, _BV(OCF1A));
+        tx_sample();
+    }
+    if (now == mb)
+        flag_set(F_TIFR, _BV(OCF1B));
+    if (now == md)
+        flag_set(F_TIFR, _BV(OCF1D));
+    if (now == mo)
+        flag_set(F_TIFR, _BV(TOV0));
+
+    motor_pulse();
+    limit_update();
+    ee_update();
+
+    was[0] = ext[0];
+    was[1] = ext[1];
+    while (nevents && events[0].when <= now) {
+        struct event *e = &events[0];
+        if (e->port == CHECK)
+            check_output(e->bits);
+        else if (e->level)
+            ext[e->port] |= e->bits;
+        else
+            ext[e->port] &= ~e->bits;
+        unschedule_first();
+    }
+    for (port = 0; port < 2; port++) {
+        if (was[port] != ext[port])
+            pin_changed(port, was[port], ext[port]);
+    }
+    if (ext[WORLD] & W_POWER_OFF)
+        finish(ee_done ? "power lost, during an eeprom write" :
+                "power lost", 0);
+    comparator_update();
+
+    return dispatch();
+}
+
+// the firmware spends simulated time in the main loop
+static void fw_pause(void)
+{
+    fw_ns += host_ns() - host_start;
+}
+
+static void fw_resume(void)
+{
+    host_start = host_ns();
+}
+
+void wdt_reset(void)
+{
+    uint64_t until = now + pass_cost;
+
+    fw_pause();
+    wdt_deadline = now + wdt_period;
+    if (!isr_depth)
+        passes++;
+    while (now < until)
+        step(until);
+    fw_resume();
+}
+
+void sim_spin(void)
+{
+    fw_pause();
+    step(now + 1000);
+    fw_resume();
+}
+
+void sim_set_sleep_mode(uint8_t mode)
+{
+    sleep_mode = mode;
+}
+
+void sim_sleep_enable(uint8_t on)
+{
+    sleep_enabled = on;
+}
+
+void sim_sleep_cpu(void)
+{
+    uint64_t t0 = now;
+
+    if (!sleep_enabled)
+        return;
+    if (!(SREG & _BV(SREG_I)))
+        finish("sleeping with interrupts disabled", 3);
+
+    fw_pause();
+    sleeps++;
+    if (!dispatch()) {
+        while (!step(UINT64_MAX))
+            ;
+    }
+    slept_usec += now - t0;
+    fw_resume();
+}
+
+
+/*
+ * main loop tasks
+ */
+extern void monitor(void), sw_timer_process(void), ir_process(void);
+extern void button_process(void), blind_process(void);
+
+static struct task_stats *task_lookup(void (*func)(void))
+{
+    struct task_stats *ts;
+    static const struct {
+        void (*func)(void);
+        const char *name;
+    } names[] = {
+#ifndef NO_MONITOR
+        { monitor, "monitor" },
+#endif
+        { sw_timer_process, "sw_timer_process" },
+        { ir_process, "ir_process" },
+        { button_process, "button_process" },
+        { blind_process, "blind_process" },
+    };
+    size_t i;
+
+    for (ts = tasks; ts < &tasks[8] && ts->func; ts++) {
+        if (ts->func == func)
+            return ts;
+    }
+    if (ts == &tasks[8])
+        return NULL;
+
+    ts->func = func;
+    ts->name = "?";
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (names[i].func == func)
+            ts->name = names[i].name;
+    }
+    return ts;
+}
+
+void sim_task_enter(void (*func)(void))
+{
+    clock_gettime(CLOCK_MONOTONIC, &task_start);
+    task_start_us = now;
+}
+
+void sim_task_exit(void (*func)(void))
+{
+    struct timespec ts;
+    struct task_stats *t;
+    double ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ns = (ts.tv_sec - task_start.tv_sec) * 1e9 +
+        (ts.tv_nsec - task_start.tv_nsec);
+
+    t = task_lookup(func);
+    if (!t)
+        return;
+    t->count++;
+    t->ns += ns;
+    if (ns > t->max_ns)
+        t->max_ns = ns;
+    if (now - task_start_us > t->max_us)
+        t->max_us = now - task_start_us;
+}
+
+
+/*
+ * eeprom.  the contents persist in a file, if one is named.  a
+ * write takes 3.4 msec, started by setting EEPE in EECR, which
+ * reads as set until it's done.  the avr-libc routines are built
+ * on the same registers, and wait their turn as on the real chip.
+ */
+volatile uint8_t *sim_eedr(void)
+{
+    if (EECR & _BV(EERE)) {
+        EECR &= ~_BV(EERE);
+        eedr_reg = eeprom[EEAR % sizeof(eeprom)];
+    }
+    return &eedr_reg;
+}
+
+// start or finish eeprom writes
+static void ee_update(void)
+{
+    if (ee_done && now >= ee_done) {
+        eeprom[ee_addr] = ee_data;
+        eeprom_wear[ee_addr]++;
+        eeprom_writes++;
+        ee_done = 0;
+        EECR &= ~(_BV(EEPE) | _BV(EEMPE));
+    }
+    if ((EECR & _BV(EEPE)) && !ee_done) {
+        ee_addr = EEAR % sizeof(eeprom);
+        ee_data = eedr_reg;
+        ee_done = now + EEPROM_WRITE_US;
+    }
+}
+
+static void ee_wait(void)
+{
+    ee_update();
+    while (EECR & _BV(EEPE))
+        sim_spin();
+}
+
+uint8_t eeprom_read_byte(const uint8_t *addr)
+{
+    ee_wait();
+    EEAR = (uintptr_t)addr;
+    EECR |= _BV(EERE);
+    return EEDR;
+}
+
+void eeprom_write_byte(uint8_t *addr, uint8_t val)
+{
+    ee_wait();
+    EEAR = (uintptr_t)addr;
+    EEDR = val;
+    EECR |= _BV(EEMPE);
+    EECR |= _BV(EEPE);
+    ee_update();
+}
+
+void eeprom_update_byte(uint8_t *addr, uint8_t val)
+{
+    if (eeprom_read_byte(addr) != val)
+        eeprom_write_byte(addr, val);
+}
+
+void eeprom_read_block(void *dst, const void *src, size_t n)
+{
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+
+    while (n--)
+        *d++ = eeprom_read_byte(s++);
+}
+
+void eeprom_write_block(const void *src, void *dst, size_t n)
+{
+    const uint8_t *s = src;
+    uint8_t *d = dst;
+
+    while (n--)
+        eeprom_write_byte(d++, *s++);
+}
+
+void eeprom_update_block(const void *src, void *dst, size_t n)
+{
+    const uint8_t *s = src;
+    uint8_t *d = dst;
+
+    while (n--)
+        eeprom_update_byte(d++, *s++);
+}
+
+static void eeprom_load(void)
+{
+    FILE *f;
+
+    memset(eeprom, 0xff, sizeof(eeprom));
+    if (!eeprom_file || !(f = fopen(eeprom_file, "rb")))
+        return;
+    if (fread(eeprom, 1, sizeof(eeprom), f) != sizeof(eeprom))
+        fprintf(stderr, "%s: short eeprom image\n", eeprom_file);
+    fclose(f);
+}
+
+static void eeprom_save(void)
+{
+    FILE *f;
+
+    if (!eeprom_file)
+        return;
+    if (!(f = fopen(eeprom_file, "wb"))) {
+        perror(eeprom_file);
+        return;
+    }
+    fwrite(eeprom, 1, sizeof(eeprom), f);
+    fclose(f);
+}
+
+
+/*
+ * the scenario
+ */
+#define BIT_US (1e6 / 9600)
+
+static uint64_t ms_to_us(double ms)
+{
+    return (uint64_t)(ms * 1000 + 0.5);
+}
+
+static void send_serial(uint64_t t, const char *s)
+{
+    double bt = t;
+    int c, i;
+
+    while ((c = (unsigned char)*s++)) {
+        schedule((uint64_t)bt, 1, _BV(PB6), 0);     // start bit
+        for (i = 0; i < 8; i++)
+            schedule((uint64_t)(bt + (i + 1) * BIT_US), 1, _BV(PB6),
+                        (c >> i) & 1);
+        schedule((uint64_t)(bt + 9 * BIT_US), 1, _BV(PB6), 1);  // stop
+        bt += 10.5 * BIT_US;    // a little slack between characters
+        serial_sent++;
+    }
+}
+
+// IR receiver output is low during a mark
+static uint64_t ir_mark(uint64_t t, unsigned us)
+{
+    schedule(t, 0, _BV(PA4), 0);
+    schedule(t + us, 0, _BV(PA4), 1);
+    return t + us;
+}
+
+static uint64_t ir_frame(uint64_t t, const char *proto,
+                        int nbits, unsigned long code)
+{
+    int i, one;
+
+    if (!strcmp(proto, "sony")) {
+        t = ir_mark(t, 2400) + 600;
+        for (i = nbits - 1; i >= 0; i--) {
+            one = (code >> i) & 1;
+            t = ir_mark(t, one ? 1200 : 600) + 600;
+        }
+    } else {
+        // NEC, or samsung, which has a shorter header
+        t = ir_mark(t, strcmp(proto, "samsung") ? 9000 : 4500) + 4500;
+        for (i = nbits - 1; i >= 0; i--) {
+            one = (code >> i) & 1;
+            t = ir_mark(t, 560) + (one ? 1690 : 560);
+        }
+        t = ir_mark(t, 560);
+    }
+    ir_frames++;
+    if (ir_nends < IR_ENDS)
+        ir_ends[ir_nends++] = t;
+    return t;
+}
+
+static char *unescape(char *s)
+{
+    char *d = s, *r = s;
+    char *end;
+
+    while (*s) {
+        if (*s != '\\' || !s[1]) {
+            *d++ = *s++;
+            continue;
+        }
+        s++;
+        switch (*s) {
+        case 'n': *d++ = '\n'; s++; break;
+        case 'r': *d++ = '\r'; s++; break;
+        case 't': *d++ = '\t'; s++; break;
+        case 'x': *d++ = strtol(s + 1, &end, 16); s = end; break;
+        default: *d++ = *s++; break;
+        }
+    }
+    *d = '\0';
+    return r;
+}
+
+static void scenario_error(const char *file, int line, const char *msg)
+{
+    fprintf(stderr, "%s:%d: %s\n", file, line, msg);
+    exit(1);
+}
+
+static void load_scenario(const char *file)
+{
+    FILE *f;
+    char buf[1024], *p, *cmd, *args;
+    double when = 0, ms;
+    uint64_t t, last = 0;
+    int line = 0, n, count, i;
+    unsigned long code;
+    char proto[16];
+
+    f = strcmp(file, "-") ? fopen(file, "r") : stdin;
+    if (!f) {
+        perror(file);
+        exit(1);
+    }
+
+    while (fgets(buf, sizeof(buf), f)) {
+        line++;
+        buf[strcspn(buf, "\r\n")] = '\0';
+        p = buf + strspn(buf, " \t");
+        if (!*p || *p == '#')
+            continue;
+
+        if (*p == '+')
+            ms = when + strtod(p + 1, &p);
+        else
+            ms = strtod(p, &p);
+        when = ms;
+        t = ms_to_us(ms);
+
+        cmd = p + strspn(p, " \t");
+        args = cmd + strcspn(cmd, " \t");
+        if (*args)
+            *args++ = '\0';
+        args += strspn(args, " \t");
+
+        if (!strcmp(cmd, "serial") || !strcmp(cmd, "serialraw")) {
+            unescape(args);
+            if (!strcmp(cmd, "serial"))
+                strcat(args, "\r");
+            send_serial(t, args);
+        } else if (!strcmp(cmd, "ir")) {
+            count = 1;
+            if (sscanf(args, "%15s", proto) != 1)
+                scenario_error(file, line, "ir: protocol?");
+            if (!strcmp(proto, "sony")) {
+                if (sscanf(args, "%*s %i %li %i", &n, &code, &count) < 2)
+                    scenario_error(file, line, "ir sony <nbits> <code>");
+            } else if (!strcmp(proto, "nec") || !strcmp(proto, "samsung")) {
+                n = 32;
+                if (sscanf(args, "%*s %li %i", &code, &count) < 1)
+                    scenario_error(file, line, "ir nec|samsung <code>");
+            } else {
+                scenario_error(file, line, "ir: unknown protocol");
+            }
+            for (i = 0; i < count; i++)
+                ir_frame(t + i * (n == 32 ? 108000 : 45000), proto, n, code);
+            t += count * (n == 32 ? 108000 : 45000);
+        } else if (!strcmp(cmd, "irrepeat")) {
+            count = atoi(args);
+            for (i = 0; i < count; i++)
+                ir_mark(ir_mark(t + i * 108000, 9000) + 2250, 560);
+        } else if (!strcmp(cmd, "irraw")) {
+            for (i = 0; *args; i++) {
+                n = strtol(args, &p, 0);
+                if (p == args)
+                    scenario_error(file, line, "irraw: bad duration");
+                args = p + strspn(p, " \t");
+                if (!(i & 1))
+                    ir_mark(t, n);
+                t += n;
+            }
+            ir_frames++;
+            if (ir_nends < IR_ENDS)
+                ir_ends[ir_nends++] = t;
+        } else if (!strcmp(cmd, "button")) {
+            schedule(t, 1, _BV(PB2), 0);
+            t += ms_to_us(atof(args));
+            schedule(t, 1, _BV(PB2), 1);
+        } else if (!strcmp(cmd, "pulse")) {
+            count = *args ? atoi(args) : 1;
+            for (i = 0; i < count; i++) {
+                schedule(t, 0, _BV(PA2), 0);
+                schedule(t + ROTATION_PULSE_US, 0, _BV(PA2), 1);
+                t += 2 * ROTATION_PULSE_US;
+            }
+        } else if (!strcmp(cmd, "motor")) {
+            if (sscanf(args, "%lf %lf %lf %lf", &motor.vmax, &motor.tau,
+                        &motor.coast, &motor.brake) != 4)
+                scenario_error(file, line,
+                    "motor <rev/s> <spinup ms> <coast> <brake>");
+            motor.tau /= 1000;
+        } else if (!strcmp(cmd, "jam")) {
+            schedule(t, WORLD, W_JAMMED, 1);
+            schedule(t + ms_to_us(atof(args)), WORLD, W_JAMMED, 0);
+        } else if (!strcmp(cmd, "powerfail")) {
+            schedule(t, WORLD, W_POWER_LOW, 1);
+            schedule(t + ms_to_us(atof(args)), WORLD, W_POWER_OFF, 1);
+        } else if (!strcmp(cmd, "powerdip")) {
+            schedule(t, WORLD, W_POWER_LOW, 1);
+            schedule(t + ms_to_us(atof(args)), WORLD, W_POWER_LOW, 0);
+        } else if (!strcmp(cmd, "limit")) {
+            motor.limit = atof(args);
+            motor.have_limit = 1;
+        } else if (!strcmp(cmd, "cost")) {
+            pass_cost = atol(args);
+        } else if (!strcmp(cmd, "expect") || !strcmp(cmd, "expectnot")) {
+            if (nchecks == 256)
+                scenario_error(file, line, "too many checks");
+            checks[nchecks].text = strdup(unescape(args));
+            checks[nchecks].not = !strcmp(cmd, "expectnot");
+            checks[nchecks].runs = -1;
+            checks[nchecks].line = line;
+            schedule(t, CHECK, nchecks++, 0);
+        } else if (!strcmp(cmd, "expectruns")) {
+            char name[32];
+            long n;
+
+            if (sscanf(args, "%31s %ld", name, &n) != 2 || n < 0)
+                scenario_error(file, line, "expectruns <task> <count>");
+            if (nchecks == 256)
+                scenario_error(file, line, "too many checks");
+            checks[nchecks].text = strdup(name);
+            checks[nchecks].runs = n;
+            checks[nchecks].line = line;
+            schedule(t, CHECK, nchecks++, 0);
+        } else if (!strcmp(cmd, "end")) {
+            end_time = t;
+        } else {
+            scenario_error(file, line, "unknown action");
+        }
+        if (t > last)
+            last = t;
+    }
+
+    if (f != stdin)
+        fclose(f);
+
+    if (!end_time)
+        end_time = last + 1000000;
+}
+
+
+/*
+ * the report
+ */
+static void finish(const char *why, int status)
+{
+    struct vector *v;
+    struct task_stats *ts;
+    unsigned long wear = 0;
+    size_t i;
+
+    fflush(stdout);
+    if (!tx_bol)
+        putchar('\n');
+
+    printf("# %s, at %.3f sec\n", why, now / 1e6);
+    printf("# firmware host time: %.3f ms\n", fw_ns / 1e6);
+    printf("# main loop: %lu passes, %lu sleeps, idle %.1f%%, "
+            "%.0f ns/pass\n", passes, sleeps,
+            now ? 100.0 * slept_usec / now : 0.0,
+            passes ? fw_ns / passes : 0.0);
+
+    for (ts = tasks; ts < &tasks[8] && ts->func; ts++) {
+        printf("# task %-18s n %8lu  mean %8.0f ns  max %8.0f ns"
+                "  blocked %6llu us\n",
+                ts->name, ts->count,
+                ts->count ? ts->ns / ts->count : 0.0, ts->max_ns,
+                (unsigned long long)ts->max_us);
+    }
+    for (v = vectors; v < &vectors[NVECTORS]; v++) {
+        if (!v->count)
+            continue;
+        printf("# isr %-19s n %8lu  mean %8.0f ns  max %8.0f ns\n",
+                v->name, v->count, v->ns / v->count, v->max_ns);
+    }
+
+    printf("# ir: %lu frames sent, %lu codes reported\n",
+            ir_frames, ir_codes);
+    if (ir_reacts)
+        printf("# ir: %lu motor starts, %llu us after a frame ended, "
+                "max %llu us\n", ir_reacts,
+                (unsigned long long)(ir_react / ir_reacts),
+                (unsigned long long)ir_react_max);
+    printf("# serial: %lu chars in, %lu chars out\n",
+            serial_sent, serial_rcvd);
+    printf("# motor: %lu starts, on %.3f sec, %lu pulses, "
+            "position %.2f revs, peak %.2f rev/s\n",
+            motor.starts, motor.on_secs, motor.pulses,
+            motor.position, motor.vpeak);
+    if (motor.stops)
+        printf("# motor: %lu stops, power off %llu us after a pulse, "
+                "max %llu us\n", motor.stops,
+                (unsigned long long)(motor.stop_lag / motor.stops),
+                (unsigned long long)motor.stop_lag_max);
+    for (i = 0; i < sizeof(eeprom); i++)
+        if (eeprom_wear[i] > wear)
+            wear = eeprom_wear[i];
+    printf("# eeprom: %lu byte writes, at most %lu to one byte\n",
+            eeprom_writes, wear);
+    if (nchecks)
+        printf("# checks: %d of %d failed\n", checks_failed, nchecks);
+    if (checks_failed && !status)
+        status = 3;
+
+    eeprom_save();
+    exit(status);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "usage: %s [-q] [-t] [-r] [-e eeprom-file] scenario-file\n"
+        "   -q  don't copy the firmware's serial output\n"
+        "   -t  timestamp the firmware's output lines\n"
+        "   -r  boot as if the limit switch had reset the chip\n"
+        "   -e  load and save the eeprom contents in a file\n",
+        prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int c, mcusr = _BV(PORF);
+
+    while ((c = getopt(argc, argv, "qtre:")) != -1) {
+        switch (c) {
+        case 'q': quiet = 1; break;
+        case 't': tstamps = 1; break;
+        case 'r': mcusr = _BV(EXTRF); break;
+        case 'e': eeprom_file = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        usage(argv[0]);
+
+    scenario = argv[optind];
+    load_scenario(scenario);
+    eeprom_load();
+
+    OCR1C = 0x3ff;
+    MCUSR = mcusr;
+
+    fw_resume();
+    firmware_main();
+
+    finish("firmware returned", 1);
+    return 1;
+}
+
+// vile:noti:sw=4
@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2013 Paul Fox, pgf@foxharp.boston.ma.us
+ *
+ * Licensed under GPL version 2, see accompanying LICENSE file
+ * for details.
+ */
+
+/*
+ * a simulated attiny861, just complete enough to run the blind
+ * controller firmware on linux.  this stands in for the avr-libc
+ * headers when building with "make host".
+ *
+ * ordinary registers are just variables.  the ones that aren't
+ * (pin inputs, interrupt flags, the timer counters) are read
+ * through functions, so that the simulation is brought up to date
+ * first.  firmware code runs in zero simulated time:  time only
+ * passes when the main loop goes around (wdt_reset()), busy-waits
+ * (hal_spin()), or sleeps.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define _AVR_IOTN861_H_ 1
+
+#define _BV(b) (1 << (b))
+
+/* data registers */
+extern volatile uint8_t SREG;
+extern volatile uint8_t PORTA, PORTB, DDRA, DDRB;
+extern volatile uint8_t MCUCR, MCUSR, GIMSK, PCMSK0, PCMSK1;
+extern volatile uint8_t TCCR0A, TCCR0B, TCNT0H, OCR0A, OCR0B;
+extern volatile uint8_t TCCR1A, TCCR1B, TC1H, TIMSK;
+extern volatile uint8_t CLKPR;
+extern volatile uint8_t ADMUX, ADCSRA, DIDR0;
+extern volatile uint8_t EECR;
+extern volatile uint16_t EEAR;
+
+// the timer1 compare registers hold all 10 bits.  see timer.h.
+extern volatile uint16_t OCR1A, OCR1B, OCR1C, OCR1D;
+
+/* registers with side effects */
+volatile uint8_t *sim_pin(int port);
+volatile uint16_t *sim_tifr(void);
+volatile uint16_t *sim_gifr(void);
+volatile uint16_t *sim_acsra(void);
+volatile uint8_t *sim_tcnt0l(void);
+volatile uint8_t *sim_eedr(void);
+unsigned int sim_tcnt1(void);
+
+#define PINA    (*sim_pin(0))
+#define PINB    (*sim_pin(1))
+#define TIFR    (*sim_tifr())       // write ones to clear, as usual
+#define GIFR    (*sim_gifr())
+#define ACSRA   (*sim_acsra())      // ACI is write one to clear
+#define TCNT0L  (*sim_tcnt0l())     // latches TCNT0H, as usual
+#define EEDR    (*sim_eedr())       // loaded by EERE, as usual
+
+/* bits */
+#define PA0 0
+#define PA1 1
+#define PA2 2
+#define PA3 3
+#define PA4 4
+#define PA5 5
+#define PA6 6
+#define PA7 7
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+
+#define PCINT8  0
+#define PCINT9  1
+#define PCINT10 2
+#define PCINT11 3
+#define PCINT12 4
+#define PCINT13 5
+#define PCINT14 6
+#define PCINT15 7
+
+#define SREG_I  7
+
+#define WDRF    3
+#define BORF    2
+#define EXTRF   1
+#define PORF    0
+
+#define ISC01   1
+#define ISC00   0
+
+#define INT1    7
+#define INT0    6
+#define PCIE1   5
+#define PCIE0   4
+
+#define INTF1   7
+#define INTF0   6
+#define PCIF    5
+
+#define OCIE1D  7
+#define OCIE1A  6
+#define OCIE1B  5
+#define OCIE0A  4
+#define OCIE0B  3
+#define TOIE1   2
+#define TOIE0   1
+#define TICIE0  0
+
+#define OCF1D   7
+#define OCF1A   6
+#define OCF1B   5
+#define OCF0A   4
+#define OCF0B   3
+#define TOV1    2
+#define TOV0    1
+#define ICF0    0
+
+#define TCW0    7
+#define ICEN0   6
+#define ICNC0   5
+#define ICES0   4
+
+#define COM1A1  7
+#define COM1A0  6
+
+#define CS13    3
+#define CS12    2
+#define CS11    1
+#define CS10    0
+
+#define ACD     7
+#define ACBG    6
+#define ACO     5
+#define ACI     4
+#define ACIE    3
+#define ACME    2
+#define ACIS1   1
+#define ACIS0   0
+
+#define ADEN    7
+
+#define ADC6D   7
+
+#define EERIE   3
+#define EEMPE   2
+#define EEPE    1
+#define EERE    0
+
+#define CLKPCE  7
+
+/* interrupts */
+#define ISR(vector, ...) void vector(void)
+#define ISR_NOBLOCK
+
+void sim_sei(void);
+#define sei()   sim_sei()
+#define cli()   do { SREG &= ~_BV(SREG_I); } while (0)
+
+/* sleep */
+#define SLEEP_MODE_IDLE     0
+#define SLEEP_MODE_ADC      1
+#define SLEEP_MODE_PWR_DOWN 2
+
+void sim_set_sleep_mode(uint8_t mode);
+void sim_sleep_enable(uint8_t on);
+void sim_sleep_cpu(void);
+#define set_sleep_mode(m)   sim_set_sleep_mode(m)
+#define sleep_enable()      sim_sleep_enable(1)
+#define sleep_disable()     sim_sleep_enable(0)
+#define sleep_cpu()         sim_sleep_cpu()
+
+/* watchdog */
+#define WDTO_15MS   0
+#define WDTO_30MS   1
+#define WDTO_60MS   2
+#define WDTO_120MS  3
+#define WDTO_250MS  4
+#define WDTO_500MS  5
+#define WDTO_1S     6
+#define WDTO_2S     7
+#define WDTO_4S     8
+#define WDTO_8S     9
+
+void wdt_enable(uint8_t timeout);
+void wdt_disable(void);
+void wdt_reset(void);
+
+/* eeprom */
+#define E2END   0x1ff
+uint8_t eeprom_read_byte(const uint8_t *addr);
+void eeprom_write_byte(uint8_t *addr, uint8_t val);
+void eeprom_update_byte(uint8_t *addr, uint8_t val);
+void eeprom_read_block(void *dst, const void *src, size_t n);
+void eeprom_write_block(const void *src, void *dst, size_t n);
+void eeprom_update_block(const void *src, void *dst, size_t n);
+#define eeprom_is_ready()   (!(EECR & _BV(EEPE)))
+#define eeprom_busy_wait()  do { } while (!eeprom_is_ready())
+
+/* util/crc16.h */
+static inline uint8_t _crc_ibutton_update(uint8_t crc, uint8_t data)
+{
+    uint8_t i;
+
+    crc ^= data;
+    for (i = 0; i < 8; i++)
+        crc = (crc & 1) ? (crc >> 1) ^ 0x8c : crc >> 1;
+    return crc;
+}
+
+/* program memory is just memory */
+#define PROGMEM
+#define PSTR(s) (s)
+typedef char prog_char;
+#define pgm_read_byte(p)    (*(const uint8_t *)(p))
+#define pgm_read_word(p)    (*(const uint16_t *)(p))
+#define pgm_read_dword(p)   (*(const uint32_t *)(p))
+#define pgm_read_ptr(p)     (*(void * const *)(p))
+
+/* for hal.h */
+void sim_spin(void);
+void sim_pin_toggle(volatile uint8_t *pin, uint8_t mask);
+void sim_task_enter(void (*func)(void));
+void sim_task_exit(void (*func)(void));
+extern uint8_t sim_sram[512];
+extern uint8_t sim_flash[8192];
+
+// vile:noti:sw=4
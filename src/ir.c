@@ -25,17 +25,13 @@
  * Warning!  the Sharp GP1UD261XK0F has Vcc and GND swapped!
  *
  */
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <avr/pgmspace.h>
-#include <avr/sleep.h>
-#include <avr/wdt.h>
+#include "hal.h"
 #include "common.h"
 #include "timer.h"
 #include "ir.h"
+#include "irdecode.h"
 #include "util.h"
-
-#define PULSE_DEBUG 1
+#include "eewrite.h"
 
 /*
  * GPIO usage.  the input needs to come from a pin with a timer
@@ -55,23 +51,200 @@
 #define CLKDIV_256  4
 #define CLKDIV_1024 5
 
-volatile static word capture_len;
-volatile static byte capture_is_low;
-volatile static byte capture_overflow;
+/*
+ * edges are timestamped by the input capture hardware against the
+ * free-running timer0, and handed to ir_process() through a small
+ * single-producer, single-consumer ring.  the capture interrupt
+ * only ever writes ir_fifo_head, and ir_process() only ever writes
+ * ir_fifo_tail, so a busy main loop can fall behind by several
+ * edges without any of them being lost.
+ *
+ * each entry is the capture timestamp with its low two bits
+ * replaced by flags.  4us of resolution is plenty for IR pulses.
+ */
+#define IR_FIFO_SIZE 16         // must be a power of 2
+#define IRF_LOW     bit(0)      // the pulse ending at this edge was low
+#define IRF_GAP     bit(1)      // long gap (or lost edges) before this one
+#define IRF_FLAGS   (IRF_LOW|IRF_GAP)
+
+static volatile word ir_fifo[IR_FIFO_SIZE];
+static volatile byte ir_fifo_head, ir_fifo_tail;
+static volatile byte ir_wraps;  // timer0 overflows since the last edge
+static word ir_last_stamp;      // timestamp of the last edge consumed
+
+word ir_fifo_overruns;          // edges dropped because the ring was full
+byte ir_fifo_peak;              // most entries ever waiting at once
 
-#define MAX_PULSES 48
-static byte ir_i;
-static long ir_accum, ir_code;
+static byte ir_edges;            // edges seen in the current frame
+static struct ir_frame ir_frame;  // the latest decoded frame
 static char ir_code_avail;
 
-#if PULSE_DEBUG
-static struct pulsepair {
-    unsigned int lowlen;
-    unsigned int highlen;
-} ir_header, ir_times[MAX_PULSES];
+#define usec_per_tick 1
+
+// a frame ends when the line has been quiet this long, or as long
+// as the decoders say, if that's sooner.
+#define IR_FRAME_GAP 10000
+static struct sw_timer ir_gap_timer;
+static word ir_wait;
+
+#ifdef IR_CAPTURE
+/*
+ * raw capture, for adding a remote we can't decode.  'y 1' streams
+ * every mark and space to the serial port as lirc "mode2" text
+ * ("pulse 560", "space 1690", and "timeout" after each frame),
+ * which host/irdecbench, or lirc's tools, can read.  IR_CAPTURE is
+ * the size of the ring holding the pulses until the uart catches
+ * up, in bytes.  a pulse is one byte, so 100 holds a 48 bit frame.
+ * if it fills, the rest of that frame is dropped.
+ *
+ * each byte is the length in 8 usec units, as a tiny float:  a
+ * 3 bit exponent and 4 bit mantissa, good to 3%, up to 15 msec.
+ * the high bit is set for a mark.
+ *
+ *   0x00       pulses were lost here
+ *   0x7f       the frame ended
+ */
+#if IR_CAPTURE > 255
+#error IR_CAPTURE is too big
+#endif
+#define CAP_MARK    0x80
+#define CAP_LOST    0x00
+#define CAP_END     0x7f
+#define CAP_MAX     0x7e    // the longest pulse
+#define CAP_LINE    13      // "space 15360\r\n"
+#if CAP_LINE > STX_LINE_ROOM
+#error a captured pulse's line won't fit
 #endif
+#define CAP_POLL    10      // msecs between tries, while the uart is busy
+
+static byte cap_ring[IR_CAPTURE];
+static byte cap_head, cap_tail;
+static char capturing;
+static char cap_skip;       // dropping pulses until the frame ends
+static char cap_lost;       // ...because the ring was full
+static char cap_live;       // this frame has pulses in the ring
+static byte cap_stx;        // where the uart ring was after our last line
+static struct sw_timer cap_timer;
+
+static byte cap_encode(word len)
+{
+    word u = (len + 4) / 8;
+    byte e = 1;
+
+    if (u < 16)
+        return u ? u : 1;   // zero is CAP_LOST
+    while (u >= 32) {
+        u = (u + 1) / 2;
+        e++;
+    }
+    if (e > 7)
+        return CAP_MAX;
+    return (e << 4) | (u - 16);
+}
 
-#define usec_per_tick 1
+static word cap_decode(byte c)
+{
+    byte e = (c >> 4) & 7;
+    word u = c & 0xf;
+
+    if (e)
+        u = (u + 16) << (e - 1);
+    return u * 8;
+}
+
+static char cap_put(byte b)
+{
+    byte next = (cap_head + 1) % IR_CAPTURE;
+
+    if (next == cap_tail)
+        return 0;
+    cap_ring[cap_head] = b;
+    cap_head = next;
+    return 1;
+}
+
+static void cap_pulse(byte mark, word len)
+{
+    if (!capturing || cap_skip)
+        return;
+    if (cap_put(cap_encode(len) | (mark ? CAP_MARK : 0))) {
+        cap_live = 1;
+    } else {
+        cap_skip = 1;
+        cap_lost = 1;
+    }
+}
+
+// if there's no room to say so yet, keep skipping until there is
+static void cap_frame_end(void)
+{
+    if (!capturing)
+        return;
+    if (cap_lost) {
+        if (!cap_put(CAP_LOST))
+            return;
+        cap_lost = 0;
+        cap_live = 1;
+    }
+    if (cap_live) {
+        if (!cap_put(CAP_END))
+            return;
+        cap_live = 0;
+    }
+    cap_skip = 0;
+}
+
+/*
+ * print what the uart has room for without waiting, so the IR
+ * fifo doesn't overrun while we print.  come back for the rest.
+ * other debug output, which the full uart may have cut short,
+ * gets a line of its own, so as not to garble ours.
+ */
+static void cap_dump(void)
+{
+    byte b;
+
+    // room for a line, after ending someone else's
+    while (cap_tail != cap_head && stx_room() >= STX_LINE_ROOM + 2) {
+        b = cap_ring[cap_tail];
+        cap_tail = (cap_tail + 1) % IR_CAPTURE;
+        if (stx_head != cap_stx)
+            crnl();
+        if (b == CAP_LOST) {
+            putstr("# lost\n");
+        } else if (b == CAP_END) {
+            putstr("timeout ");
+            putdec16(IR_FRAME_GAP);
+            crnl();
+        } else {
+            putstr((b & CAP_MARK) ? "pulse " : "space ");
+            putdec16(cap_decode(b));
+            crnl();
+        }
+        cap_stx = stx_head;
+    }
+    if (cap_tail != cap_head)
+        sw_timer_start(&cap_timer, cap_dump, CAP_POLL, 0);
+}
+
+/* monitor support:  'y 1' starts streaming, 'y 0' stops.  the
+ * first frame is the one after the current one, if any. */
+void ir_capture(char on)
+{
+    sw_timer_stop(&cap_timer);
+    cap_head = cap_tail = 0;
+    cap_lost = cap_live = 0;
+    cap_skip = 1;
+    cap_stx = stx_head;
+    capturing = on;
+}
+#else
+#define cap_pulse(mark, len)
+#define cap_frame_end()
+#define cap_dump()
+#endif
+
+static void learned_read(void);
 
 /*
  * set up initial chip conditions
@@ -92,243 +265,444 @@ ir_init(void)
     TCCR0B = CLKDIV_8;
 #endif
 
-    // start the timer
+    // start the timer.  it runs freely from here on, and edges
+    // are timestamped against it.
     TCNT0H = 0;
     TCNT0L = 0;
 
     // timer0 overflow int enable, and input capture event int enable.
     TIFR = bit(TOV0) | bit(ICF0);   // clear first
     TIMSK |= bit(TOIE0) | bit(TICIE0);
+
+    learned_read();
 }
 
 
 /*
  * timer0 overflow interrupt handler.
- * if we hit the overflow without getting a transition on the IR
- * line, then we're certainly "between" IR packets.
+ * the timer runs freely, so we just count wraps, in order to tell
+ * a long gap between edges from a short one.
  */
 ISR(TIMER0_OVF_vect)
 {
-    capture_overflow = 1;
+    ISR_PROF_ENTER();
+
+    if (ir_wraps < 255)
+        ir_wraps++;
+
+    ISR_PROF_EXIT(ISRP_T0_OVF);
 }
 
 /*
  * input capture event handler
- * the "event" is a transition on the IR line.  we save the
- * captured count, and restart the timer from zero again.
+ * the "event" is a transition on the IR line.  we queue the
+ * captured timestamp, along with the pulse's polarity.  this
+ * used to run with interrupts enabled, but it's now short, and
+ * must not be reentered while it updates the ring.
  */
-ISR(TIMER0_CAPT_vect, ISR_NOBLOCK)
+ISR(TIMER0_CAPT_vect)
 {
-    // save the captured time interval
-    capture_len = OCR0A | (OCR0B << 8); // aka ICR0
+    static word prev_stamp;
+    static byte lost;
+    word stamp, now;
+    byte head, next, wraps, flags, fill;
+    ISR_PROF_ENTER();
 
-    // if we captured a rising edge, the pulse was low
-    capture_is_low = !!(TCCR0A & bit(ICES0));
+    stamp = (OCR0A | (OCR0B << 8)) & ~IRF_FLAGS; // aka ICR0
+    now = TCNT0L;
+    now |= TCNT0H << 8;
 
-    // restart the timer
-    TCNT0H = 0;
-    TCNT0L = 0;
+    // if we captured a rising edge, the pulse was low
+    flags = (TCCR0A & bit(ICES0)) ? IRF_LOW : 0;
 
     // change detection edge, and clear interrupt flag -- it's
     // set as result of detection edge change
-    cli();
     TCCR0A ^= bit(ICES0);
     TIFR = bit(ICF0);
+
+    // an overflow that happened after the capture, but was
+    // serviced before us, belongs to the next edge, not this one.
+    wraps = ir_wraps;
+    ir_wraps = 0;
+    if (wraps && now < stamp && !(TIFR & bit(TOV0))) {
+        wraps--;
+        ir_wraps = 1;
+    }
+
+    // more than a full timer cycle since the previous edge?
+    if (wraps > 1 || (wraps && stamp >= prev_stamp))
+        flags |= IRF_GAP;
+    prev_stamp = stamp;
+
+    head = ir_fifo_head;
+    next = (head + 1) & (IR_FIFO_SIZE - 1);
+    if (next == ir_fifo_tail) {
+        // no room.  drop the edge, and make sure the decoder
+        // resynchronizes at the next one we do manage to queue.
+        ir_fifo_overruns++;
+        lost = 1;
+    } else {
+        if (lost)
+            flags |= IRF_GAP;
+        lost = 0;
+
+        ir_fifo[head] = stamp | flags;
+        ir_fifo_head = next;
+
+        post_event(EV_IR);
+
+        fill = (next - ir_fifo_tail) & (IR_FIFO_SIZE - 1);
+        if (fill > ir_fifo_peak)
+            ir_fifo_peak = fill;
+    }
+
+    ISR_PROF_EXIT(ISRP_T0_CAPT);
+}
+
+/*
+ * returns true if no edges are waiting, and the IR line has been
+ * idle for longer than the given number of microseconds.
+ */
+static char ir_idle_for(word usecs)
+{
+    word now;
+    byte wraps, empty;
+
+    cli();
+    now = TCNT0L;
+    now |= TCNT0H << 8;
+    wraps = ir_wraps;
+    empty = (ir_fifo_tail == ir_fifo_head);
     sei();
 
+    if (!empty)
+        return 0;
+
+    if (wraps > 1 || (wraps && now >= ir_last_stamp))
+        return 1;
+
+    return (word)(now - ir_last_stamp) > usecs;
+}
+
+/*
+ * the IR line has gone quiet, or an edge arrived after a long
+ * gap.  either way, whatever we've accumulated is complete.
+ */
+static void ir_frame_end(void)
+{
+    if (ir_decode_end(&ir_frame))
+        ir_code_avail = 1;
+    ir_edges = 0;
+    cap_frame_end();
 }
 
 void
 ir_process(void)
 {
-    word len = 0;
-    static word lowlen;
+    word len = 0, wait;
+    word stamp;
+    byte tail;
     byte low;
-    byte overflow;
 
-    /* the "input capture" interrupt handler will record the
-     * most recent pulse's length and polarity.
+    /* the "input capture" interrupt handler queues the timestamp
+     * and polarity of every edge.  the pulse lengths are the
+     * differences between successive timestamps.
      */
-    while (capture_len || capture_overflow) {
+    while ((tail = ir_fifo_tail) != ir_fifo_head) {
 
-        cli();
-        // capture length, polarity, and overflow data with interrupts off
-        len = capture_len;
-        low = capture_is_low;
-        overflow = capture_overflow;
+        stamp = ir_fifo[tail];
+        ir_fifo_tail = (tail + 1) & (IR_FIFO_SIZE - 1);
 
-        capture_overflow = 0;
-
-        // if this is non-zero at top of loop, then a new pulse arrived.
-        capture_len = 0;
-
-        sei();
+        low = stamp & IRF_LOW;
+        len = (stamp & ~IRF_FLAGS) - ir_last_stamp;
+        ir_last_stamp = stamp & ~IRF_FLAGS;
 
         len *= usec_per_tick;  // ticks -> microseconds
 
         // led_flash();
 
-        // if we had an overflow or a very long pulse, then the
-        // current capture_len is meaningless -- it's just a
+        // if we had a timer wrap or a very long pulse, then the
+        // current pulse length is meaningless -- it's just a
         // gap, or the last remnant of a gap.
-        if (overflow || len > 10000) {
-            if (ir_i > 3) {
-                ir_code = ir_accum;
-                ir_code_avail = 1;
-            }
-            ir_i = 0;
-            ir_accum = 0;
-            lowlen = 0;
-            // overflow ? putch('v'):putch('o');
-            overflow = 0;
+        if ((stamp & IRF_GAP) || len > IR_FRAME_GAP) {
+            ir_frame_end();
             continue;
         }
 
+        if (ir_edges < 255)
+            ir_edges++;
 
-        if ( !low &&
-#if BEFORE
-#define near(val, ref) ((ref + ref/6) > val && val > (ref - ref/6))
-            /* remotes emit different header pairs... */
-            ((near(lowlen, 4850) && near(len, 4550)) ||  // samsung
-             (near(lowlen, 2650) && near(len, 500))  ||  // sony
-             (near(lowlen, 3750) && near(len, 1670)) ||  // panasonic
-             (near(lowlen, 9065) && near(len, 4500)))    // packard bell
-#else
-            /* ... but they have a lot in common */
-            (len > 2000 || lowlen > 2000)
-#endif
-            )
-        {
-            ir_i = 0;
-#if PULSE_DEBUG
-            ir_header.lowlen = lowlen;
-            ir_header.highlen = len;
-#endif
-            ir_accum = 0;
-            lowlen = 0;
-            continue;
-        }
+        cap_pulse(low, len);
 
-        if (low) {
-            /* we don't bother recording low pulses.  just keep
-             * track of how long they were. */
-            lowlen = len;
-            continue;
+        // a frame with all the bits its protocol expects is
+        // over now, without waiting for the line to go quiet.
+        ir_wait = ir_decode_edge(low, len);
+        if (ir_wait == IR_DECODE_DONE)
+            ir_frame_end();
+    }
+
+    // with no more edges coming, a frame is over once the line
+    // has been quiet for longer than any space inside a frame of
+    // the protocols still decoding it.  if it isn't yet, come
+    // back when it might be.
+    if (ir_edges) {
+        wait = (ir_wait < IR_FRAME_GAP) ? ir_wait : IR_FRAME_GAP;
+        if (ir_idle_for(wait))
+            ir_frame_end();
+        else
+            sw_timer_start(&ir_gap_timer, ir_process, wait / 1000 + 1, 0);
+    }
+
+    cap_dump();
+}
+
+/*
+ * the remotes we respond to, and what their buttons do, are listed
+ * in remotes/map, and described by the lircd.conf files there.  the
+ * build turns those into a perfect hash table of the codes we'll
+ * see for each of those buttons (see host/irtable.c).
+ */
+struct irc {
+    int32_t ir_code;
+    char ir_cmd;
+};
+
+#include "irhash.h"
+#include "ir_table.h"
+
+/*
+ * codes learned from other remotes are kept at the top of the
+ * eeprom, just above the position journal (see blind.c).  at boot
+ * they're read into ram, where they stay sorted by code, so that
+ * get_ir() can binary search them before trying the flash table.
+ * a learned code overrides the table.
+ *
+ * learning is started with "alt alt alt alt stop", or from the
+ * monitor.  the next presses of a new remote's buttons are taken,
+ * in order, as top, middle, bottom, stop, and alt.  each gets a
+ * chirp.  the codes are held aside, and only go into the table,
+ * and get saved, after the last one.  if a button isn't pressed in
+ * time, learning is abandoned, and nothing changes.
+ */
+#define LEARN_MAX       10      // two remotes' worth
+#define LEARN_MAGIC     0x4c
+#define LEARN_TIMEOUT   10000   // msecs to wait for each button
+#define LEARN_RETRY     100     // msecs, if the eeprom queue is full
+
+static struct ir_learned {
+    byte magic;
+    byte n;
+    uint32_t code[LEARN_MAX];   // sorted
+    char cmd[LEARN_MAX];
+    byte crc;
+} learned;
+
+static char learning;           // the button we're waiting for, or 0
+static uint32_t learn_codes[IR_ALT - IR_TOP + 1];  // so far, by button
+static struct sw_timer learn_timer; // also retries a save
+
+static byte learned_crc(void)
+{
+    byte crc, *p;
+
+    crc = 0;
+    for (p = (byte *)&learned; p < &learned.crc; p++)
+        crc = _crc_ibutton_update(crc, *p);
+    return crc;
+}
+
+static void learned_read(void)
+{
+    eeprom_read_block(&learned, (void *)IR_LEARN_EEPROM, sizeof(learned));
+    if (learned.magic != LEARN_MAGIC || learned.n > LEARN_MAX ||
+            learned.crc != learned_crc())
+        learned.n = 0;
+}
+
+static void learned_save(void)
+{
+    learned.magic = LEARN_MAGIC;
+    learned.crc = learned_crc();
+    if (!ee_write(&learned, IR_LEARN_EEPROM, sizeof(learned)))
+        sw_timer_start(&learn_timer, learned_save, LEARN_RETRY, 0);
+}
+
+static char learned_cmd(uint32_t code)
+{
+    byte lo, hi, mid;
+
+    lo = 0;
+    hi = learned.n;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (learned.code[mid] < code)
+            lo = mid + 1;
+        else if (learned.code[mid] > code)
+            hi = mid;
+        else
+            return learned.cmd[mid];
+    }
+    return 0;
+}
+
+// add a code, or give a known one a new command
+static void learned_insert(uint32_t code, char cmd)
+{
+    byte i, j;
+
+    for (i = 0; i < learned.n && learned.code[i] < code; i++)
+        ;
+
+    if (i == learned.n || learned.code[i] != code) {
+        for (j = learned.n; j > i; j--) {
+            learned.code[j] = learned.code[j - 1];
+            learned.cmd[j] = learned.cmd[j - 1];
         }
+        learned.code[i] = code;
+        learned.n++;
+    }
+    learned.cmd[i] = cmd;
+}
 
-        // if a remote puts out lots of bits (e.g., panasonic),
-        // we'll only save the last 32 of them.  by setting
-        // MAX_PULSES on the high side (i.e., 48, rather than
-        // just 32), we're hoping that leading bits are likely a
-        // fixed prefix that we can discard without losing
-        // uniqueness.
-        if (ir_i >= MAX_PULSES) { // we've gotten too many bits
-            lowlen = len;
+// will the codes learned so far, up to button b, fit in the table?
+static char learn_room(byte b)
+{
+    byte i, j, n;
+
+    n = learned.n;
+    for (i = 0; i <= b; i++) {
+        if (learned_cmd(learn_codes[i]))
             continue;
-        }
+        for (j = 0; j < i && learn_codes[j] != learn_codes[i]; j++)
+            ;
+        if (j == i)
+            n++;
+    }
+    return n <= LEARN_MAX;
+}
 
-        // make way for a new bit
-        ir_accum <<= 1;
-
-        // zeros and ones may be short or long.  we don't really
-        // care.  what's important is that in all remotes i've
-        // looked at, either the low pulse is always short, or
-        // the high pulse is always short -- whichever it is, the
-        // bit is descriminated by the other one being longer
-        // than a millisecond. */
-        if (len > 1000 || lowlen > 1000)  {
-            ir_accum |= 1;
-        }
+static void learn_abort(void)
+{
+    putstr("learning abandoned\n");
+    tone_start(TONE_ABORT);
+    learning = 0;
+}
 
-#if PULSE_DEBUG
-        ir_times[ir_i].lowlen = lowlen;
-        ir_times[ir_i].highlen = len;
-#endif
+static void learn_code(uint32_t code)
+{
+    byte b = learning - IR_TOP;
 
-        lowlen = 0;
+    // a held, or pressed again, button isn't the next one
+    if (b && code == learn_codes[b - 1])
+        return;
 
-        // if we've accumulated a full complement of bits, save it off
-        if (++ir_i >= MAX_PULSES) {
-            ir_code = ir_accum;
-            ir_code_avail = 1;
-        }
+    print_tstamp();
+    p_hex32(code);
+    p_hex(learning);
+    crnl();
+
+    learn_codes[b] = code;
+    if (!learn_room(b)) {
+        putstr("no room\n");
+        sw_timer_stop(&learn_timer);
+        learn_abort();
+        return;
     }
+
+    if (learning == IR_ALT) {
+        sw_timer_stop(&learn_timer);
+        learning = 0;
+        for (b = 0; b <= IR_ALT - IR_TOP; b++)
+            learned_insert(learn_codes[b], IR_TOP + b);
+        learned_save();
+        putstr("learned\n");
+        tone_start(TONE_CONFIRM);
+        return;
+    }
+
+    learning++;
+    tone_start(TONE_CHIRP);
+    sw_timer_start(&learn_timer, learn_abort, LEARN_TIMEOUT, 0);
 }
 
-/* to add a remote, press the keys you've chosen for all of
- * up/down/middle/stop/alt and copy/paste them to this table.
+/*
+ * 0 shows the learned codes, 1 starts learning, and 2 forgets
+ * them all.
  */
-struct irc {
-    long ir_code;
-    char ir_cmd;
-} ir_remote_codes [] PROGMEM = {
-    // pgf's X-10 "tv buddy" remote (as currently programed)
-    { 0xe0e048b7, IR_TOP },        // up (P+)
-    { 0xe0e0d02f, IR_MIDDLE },     // left (V-)
-    { 0xe0e0e01f, IR_MIDDLE },     // right (V+)
-    { 0xe0e008f7, IR_BOTTOM },     // down (P-)
-    { 0xe0e0f00f, IR_STOP },       // center (mute)
-    { 0xe0e040bf, IR_ALT },        // power
-
-    // samsung tv remote
-    { 0xe0e006f9, IR_TOP },        // up
-    { 0xe0e0a659, IR_MIDDLE },     // left
-    { 0xe0e046b9, IR_MIDDLE },     // right
-    { 0xe0e08679, IR_BOTTOM },     // down
-    { 0xe0e016e9, IR_STOP },       // enter
-    { 0xe0e0b44b, IR_ALT },        // exit
-
-    // ancient packard bell 
-    { 0x08f7906f, IR_TOP },        // up     
-    { 0x08f710ef, IR_MIDDLE },     // left   
-    { 0x08f7d02f, IR_MIDDLE },     // right  
-    { 0x08f750af, IR_BOTTOM },     // down   
-    { 0x08f7708f, IR_STOP },       // enter  
-    { 0x08f7e21d, IR_ALT },        // aux3   
-
-    // sony video8
-    { 0x2de, IR_ALT },             // data
-    { 0x6ce, IR_TOP },             // rew
-    { 0x1ce, IR_TOP },             // ff
-    { 0x2ce, IR_MIDDLE },          // play
-    { 0x0ce, IR_STOP },            // stop
-    { 0x4ce, IR_BOTTOM },          // pause
-    { 0x62e, IR_BOTTOM },          // slow
-
-    // panasonic dvd
-    { 0x0d00a1ac, IR_TOP },        // up     
-    { 0x0d00e1ec, IR_MIDDLE },     // left   
-    { 0x0d00111c, IR_MIDDLE },     // right  
-    { 0x0d00616c, IR_BOTTOM },     // down   
-    { 0x0d00414c, IR_STOP },       // enter  
-    { 0x0d00010c, IR_ALT },        // menu   
-
-    { 0, 0}
-};
+void ir_learn(char cmd)
+{
+    byte i;
+    uint32_t code;
+    char ircmd;
+
+    switch (cmd) {
+    case 0:
+        for (i = 0; i < learned.n; i++) {
+            code = learned.code[i];
+            ircmd = learned.cmd[i];
+            p_hex32(code);
+            p_hex(ircmd);
+            crnl();
+        }
+        break;
+
+    case 1:
+        // the last save may still be going out from our copy,
+        // or waiting to
+        if (learning || ee_busy() || sw_timer_pending(&learn_timer)) {
+            tone_start(TONE_ABORT);
+            break;
+        }
+        putstr("learning\n");
+        learning = IR_TOP;
+        sw_timer_start(&learn_timer, learn_abort, LEARN_TIMEOUT, 0);
+        break;
+
+    case 2:
+        if (learning || ee_busy() || sw_timer_pending(&learn_timer))
+            break;
+        learned.n = 0;
+        learned_save();
+        break;
+    }
+}
 
 /*
- * if there's an IR press available, return an index into the table above.
+ * if there's an IR press available, return its command.  learned
+ * codes are checked first, then the table.
  *
  * may return 0 if:
  *  - no press is available
- *  - the received code isn't configured in table, above.
+ *  - the press is a repeat, from a button being held
+ *  - the received code isn't learned, or configured in the table.
  *  - the received code matches the previous, and not enough time
  *    has passed.
+ *  - we're learning, and the press was taken for that.
  */
 char get_ir(void)
 {
-    struct irc *ircp;
-    long ircode;
+    const struct irc *ircp;
+    word h;
+    byte d;
     int ircmd;
+    int32_t ir_code;
 
     static long dup_timer;
-    static long last_ir_code;
+    static int32_t last_ir_code;
 
     if (!ir_code_avail)
         return 0;
 
     ir_code_avail = 0;
 
+    // a held button.  remotes that just send the code again are
+    // caught by the timer.
+    if (ir_frame.repeat) {
+        dup_timer = get_ms_timer();
+        return 0;
+    }
+
+    ir_code = ir_frame.code;
     if (!check_timer(dup_timer, 130) && last_ir_code == ir_code) {
         dup_timer = get_ms_timer();
         return 0;
@@ -337,51 +711,46 @@ char get_ir(void)
     dup_timer = get_ms_timer();
     last_ir_code = ir_code;
 
-    ircp = ir_remote_codes;
+    if (learning) {
+        learn_code(ir_code);
+        return 0;
+    }
+
+    ircmd = learned_cmd(ir_code);
+    if (!ircmd) {
+        // the only place this code can be in the table
+        h = ir_hash(ir_code, IR_HASH_SEED);
+        d = pgm_read_byte(&ir_hash_disp[ir_hash_bucket(h, IR_HASH_BUCKETS)]);
+        ircp = &ir_remote_codes[ir_hash_slot(h, d, IR_TABLE_SIZE)];
 
-    // loop through the table, and return the index on a match.
-    while(1) {
-        ircode = pgm_read_dword(&ircp->ir_code);
-        if (!ircode) {
+        if ((int32_t)pgm_read_dword(&ircp->ir_code) != ir_code) {
             print_tstamp();
             p_hex32(ir_code); crnl();
             return 0;
         }
-
-        if (ir_code == ircode) {
-            ircmd = pgm_read_byte(&ircp->ir_cmd);
-            print_tstamp();
-            p_hex32(ir_code); 
-            p_hex(ircmd); crnl();
-            return ircmd;
-        }
-
-        ircp++;
+        ircmd = pgm_read_byte(&ircp->ir_cmd);
     }
+
+    print_tstamp();
+    p_hex32(ir_code); 
+    p_hex(ircmd); crnl();
+    return ircmd;
 }
 
 void ir_show_code(void)
 {
-#if PULSE_DEBUG
-    byte i;
-
-    putstr("head:\t");
-    putdec16(ir_header.lowlen);
-    putch('\t');
-    putdec16(ir_header.highlen);
+    p_dec(ir_frame.proto);
+    p_dec(ir_frame.nbits);
+    p_hex(ir_frame.addr);
+    p_hex(ir_frame.cmd);
+    p_hex32(ir_frame.code);
+    p_dec(ir_frame.repeat);
     crnl();
-    for (i = 0; i < MAX_PULSES; i++) {
-        puthex(i);
-        putch('\t');
-        putdec16(ir_times[i].lowlen);
-        putch('\t');
-        putdec16(ir_times[i].highlen);
-        crnl();
-    }
-#endif
-
-    p_hex32(ir_code);
+    p_dec(ir_fifo_overruns);
+    p_dec(ir_fifo_peak);
     crnl();
+    ir_fifo_overruns = 0;
+    ir_fifo_peak = 0;
 }
 
 // vile:noti:sw=4
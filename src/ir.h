@@ -9,6 +9,11 @@ void ir_process(void);
 void ir_show_code(void);
 void ir_init(void);
 char get_ir(void);
+void ir_learn(char cmd);
+void ir_capture(char on);
+
+// learned codes live in the top 64 bytes of the eeprom
+#define IR_LEARN_EEPROM (E2END + 1 - 64)
 
 enum {
     IR_TOP = 1,
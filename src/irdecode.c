@@ -0,0 +1,434 @@
+/*
+ * Copyright (c) 2013 Paul Fox, pgf@foxharp.boston.ma.us
+ *
+ * Licensed under GPL version 2, see accompanying LICENSE file
+ * for details.
+ *
+ * -----------
+ *
+ * each IR protocol we know is described by a timing template
+ * below, and every mark and space is given to all of their
+ * decoders at once.  a decoder gives up on a pulse that doesn't
+ * fit its template, until the next frame, or the next header mark
+ * that does fit.  a frame is over when a decoder has all the bits
+ * it expects, or when the line has been quiet for longer than any
+ * space inside a frame of the protocols still decoding.  then the
+ * first decoder (in table order) holding a complete frame has
+ * decoded it.
+ *
+ * bits are kept in the order they arrive, first bit highest --
+ * even for protocols that send the least significant bit first --
+ * because that's how lirc describes remotes, and the code table is
+ * built from lirc's descriptions (see host/irtable.c).  so the
+ * address and command of those protocols are bit reversed.
+ */
+#include "hal.h"
+#include "common.h"
+#include "irdecode.h"
+
+// how the bits are encoded
+#define ENC_SPACE   0   // pulse distance:  by the length of the space
+#define ENC_MARK    1   // pulse width:  by the length of the mark
+#define ENC_BIPHASE 2   // manchester:  by the direction of the mid-bit edge
+#define ENC_ANY     3   // whichever of the mark or space is long
+
+// template flags, for the bi-phase protocols
+#define BI_MARK_ONE bit(0)  // a one starts with a mark (rc6), not a space
+#define BI_TRAILER  bit(1)  // bit 4 is twice as long (rc6)
+
+struct ir_template {
+    byte proto;
+    byte encoding;
+    byte flags;
+    byte minbits, maxbits;
+    word hdr_mark, hdr_space;   // zero if there's no header
+    word rpt_space;             // the header space of a repeat frame
+    word unit;                  // the short mark or space, or half bit
+    word one;                   // the long one, that makes a 1
+    word gap;                   // a quiet line longer than this ends a frame
+};
+
+static const struct ir_template ir_templates[] PROGMEM = {
+    // proto        encoding     flags bits    header      rpt  unit   one   gap
+    { IRP_NEC,      ENC_SPACE,   0,   32, 32, 9000, 4500, 2250, 560, 1690, 2300 },
+    { IRP_SAMSUNG,  ENC_SPACE,   0,   32, 32, 4500, 4500,    0, 560, 1690, 2300 },
+    { IRP_SIRC,     ENC_MARK,    0,   12, 20, 2400,  600,    0, 600, 1200,  900 },
+    { IRP_KASEIKYO, ENC_SPACE,   0,   48, 48, 3456, 1728,    0, 432, 1296, 1800 },
+    { IRP_RC5,      ENC_BIPHASE, 0,   14, 14,    0,    0,    0, 889,    0, 2300 },
+    { IRP_RC6,      ENC_BIPHASE, BI_MARK_ONE|BI_TRAILER,
+                                      21, 21, 2666,  889,    0, 444,    0, 1600 },
+    // what ir.c used to do:  any mark over 2000us is a header, any
+    // mark or space over 1000us makes a 1, and the first 48 bits
+    // count.  data spaces are rarely over 2ms.
+    { IRP_OTHER,    ENC_ANY,     0,    4, 48, 2000,    0,    0,   0, 1000, 2500 },
+};
+
+#define NTEMPLATES (sizeof(ir_templates) / sizeof(ir_templates[0]))
+
+// decoder states
+#define ST_IDLE     0
+#define ST_HEADER   1   // seen the header mark
+#define ST_DATA     2
+#define ST_REPEAT   3   // seen a repeat frame's header
+#define ST_REPEATED 4   // ...and its mark
+#define ST_FAIL     5
+#define ST_MASK     0x0f
+#define ST_HALF     bit(4)  // bi-phase:  have the first half of a bit
+#define ST_HALF_MARK bit(5) // ...and it was a mark
+#define ST_LONG     bit(4)  // ENC_ANY:  the last mark was long
+
+static struct ir_decoder {
+    byte state;
+    byte nbits;
+    word hi;            // bits shifted out of accum
+    uint32_t accum;
+} ir_decoders[NTEMPLATES];
+
+// the last rc5 or rc6 frame, to tell a new press from a held one
+static int32_t rc_last_code;
+static byte rc_last_toggle;
+
+// receivers stretch marks, and shrink spaces, by around this much.
+// we take it back off, and allow as much again either way.
+#define IR_SKEW 75
+#define IR_SLOP 100
+
+static char near(word len, word ref)
+{
+    word tol = ref / 4 + IR_SLOP;
+
+    return len + tol >= ref && len <= ref + tol;
+}
+
+static void add_bit(struct ir_decoder *d, byte b)
+{
+    d->hi = (d->hi << 1) | (byte)(d->accum >> 31);
+    d->accum = (d->accum << 1) | b;
+    d->nbits++;
+}
+
+// one half of a bi-phase bit, either a mark or a space
+static void half_bit(struct ir_decoder *d, byte flags, byte mark)
+{
+    byte first;
+
+    if (!(d->state & ST_HALF)) {
+        d->state |= ST_HALF | (mark ? ST_HALF_MARK : 0);
+        return;
+    }
+
+    first = (d->state & ST_HALF_MARK) ? 1 : 0;
+    d->state &= ~(ST_HALF | ST_HALF_MARK);
+    if (first == mark) {    // no edge in the middle
+        d->state = ST_FAIL;
+        return;
+    }
+    add_bit(d, (flags & BI_MARK_ONE) ? first : mark);
+}
+
+static void decode_data(struct ir_decoder *d, const struct ir_template *tp,
+                byte mark, word len)
+{
+    byte flags, n, w;
+    word unit, one;
+
+    unit = pgm_read_word(&tp->unit);
+    one = pgm_read_word(&tp->one);
+
+    switch (pgm_read_byte(&tp->encoding)) {
+    case ENC_SPACE:
+        if (mark) {
+            if (!near(len, unit))
+                d->state = ST_FAIL;
+        } else if (near(len, unit)) {
+            add_bit(d, 0);
+        } else if (near(len, one)) {
+            add_bit(d, 1);
+        } else {
+            d->state = ST_FAIL;
+        }
+        break;
+
+    case ENC_MARK:
+        if (!mark) {
+            if (!near(len, unit))
+                d->state = ST_FAIL;
+        } else if (near(len, unit)) {
+            add_bit(d, 0);
+        } else if (near(len, one)) {
+            add_bit(d, 1);
+        } else {
+            d->state = ST_FAIL;
+        }
+        break;
+
+    case ENC_BIPHASE:
+        // a pulse is one or more half bits long
+        flags = pgm_read_byte(&tp->flags);
+        n = (len + unit / 2) / unit;
+        if (n == 0 || n > 4) {
+            d->state = ST_FAIL;
+            break;
+        }
+        while (n && d->state != ST_FAIL) {
+            w = ((flags & BI_TRAILER) && d->nbits == 4) ? 2 : 1;
+            if (n < w) {
+                d->state = ST_FAIL;
+                break;
+            }
+            n -= w;
+            half_bit(d, flags, mark);
+        }
+        break;
+
+    case ENC_ANY:
+        if (mark) {
+            d->state = ST_DATA | (len > one ? ST_LONG : 0);
+        } else {
+            if (d->nbits < pgm_read_byte(&tp->maxbits))
+                add_bit(d, (d->state & ST_LONG) || len > one);
+            d->state = ST_DATA;
+        }
+        return;
+    }
+
+    if (d->nbits > pgm_read_byte(&tp->maxbits))
+        d->state = ST_FAIL;
+}
+
+static void decode_edge(struct ir_decoder *d, const struct ir_template *tp,
+                byte mark, word len)
+{
+    word hdr_mark, rpt_space;
+    byte any;
+
+    any = (pgm_read_byte(&tp->encoding) == ENC_ANY);
+    hdr_mark = pgm_read_word(&tp->hdr_mark);
+
+    // a header mark starts a new frame, whatever we were doing
+    if (mark && hdr_mark && (any ? len > hdr_mark : near(len, hdr_mark))) {
+        d->state = ST_HEADER;
+        d->nbits = 0;
+        d->hi = 0;
+        d->accum = 0;
+        return;
+    }
+
+    switch (d->state & ST_MASK) {
+    case ST_IDLE:
+        // without a header (rc5), a frame starts with the second,
+        // marked, half of its first bit.
+        if (hdr_mark || !mark) {
+            d->state = ST_FAIL;
+            break;
+        }
+        d->state = ST_DATA | ST_HALF;
+        d->nbits = 0;
+        d->hi = 0;
+        d->accum = 0;
+        decode_data(d, tp, mark, len);
+        break;
+
+    case ST_HEADER:
+        rpt_space = pgm_read_word(&tp->rpt_space);
+        if (mark)
+            d->state = ST_FAIL;
+        else if (any || near(len, pgm_read_word(&tp->hdr_space)))
+            d->state = ST_DATA;
+        else if (rpt_space && near(len, rpt_space))
+            d->state = ST_REPEAT;
+        else
+            d->state = ST_FAIL;
+        break;
+
+    case ST_DATA:
+        decode_data(d, tp, mark, len);
+        break;
+
+    case ST_REPEAT:
+        if (mark && near(len, pgm_read_word(&tp->unit)))
+            d->state = ST_REPEATED;
+        else
+            d->state = ST_FAIL;
+        break;
+
+    default:
+        d->state = ST_FAIL;
+        break;
+    }
+}
+
+/*
+ * after an edge, whether this decoder's frame is complete, or how
+ * long a quiet line must be before it might be.
+ */
+static word decode_wait(struct ir_decoder *d, const struct ir_template *tp,
+                byte mark)
+{
+    word hdr_space;
+    byte maxbits;
+
+    if ((d->state & ST_MASK) == ST_REPEATED)
+        return IR_DECODE_DONE;
+
+    // a mark is under way.  the frame can't end until it does.
+    if (!mark)
+        return IR_DECODE_WAIT;
+
+    if ((d->state & ST_MASK) == ST_HEADER) {
+        hdr_space = pgm_read_word(&tp->hdr_space);
+        if (!hdr_space)
+            return IR_DECODE_WAIT;
+        return hdr_space + hdr_space / 4 + IR_SLOP;
+    }
+
+    // a full count of bits ends the frame (with a stop mark, if
+    // there is one).  a bi-phase frame may end with a half bit
+    // of quiet line.
+    maxbits = pgm_read_byte(&tp->maxbits);
+    switch (pgm_read_byte(&tp->encoding)) {
+    case ENC_BIPHASE:
+        if (d->nbits == maxbits - 1 && (d->state & ST_HALF_MARK))
+            return IR_DECODE_DONE;
+        /* FALLTHROUGH */
+    case ENC_SPACE:
+    case ENC_MARK:
+        if (d->nbits == maxbits)
+            return IR_DECODE_DONE;
+        break;
+    }
+
+    return pgm_read_word(&tp->gap);
+}
+
+/*
+ * give a mark (carrier on), or a space, to all of the decoders.
+ * returns IR_DECODE_DONE if one of them now has a complete frame,
+ * otherwise how long (in usecs) the line must stay quiet before
+ * one might.  that's IR_DECODE_WAIT if none of them can say.
+ */
+word ir_decode_edge(byte mark, word len)
+{
+    byte i, live = 0;
+    word wait = 0, w;
+
+    if (mark)
+        len = (len > IR_SKEW) ? len - IR_SKEW : 0;
+    else
+        len += IR_SKEW;
+
+    for (i = 0; i < NTEMPLATES; i++) {
+        decode_edge(&ir_decoders[i], &ir_templates[i], mark, len);
+
+        switch (ir_decoders[i].state & ST_MASK) {
+        case ST_IDLE:
+        case ST_FAIL:
+            continue;
+        }
+        live = 1;
+        w = decode_wait(&ir_decoders[i], &ir_templates[i], mark);
+        if (w == IR_DECODE_DONE)
+            return IR_DECODE_DONE;
+        if (w > wait)
+            wait = w;
+    }
+
+    return live ? wait : IR_DECODE_WAIT;
+}
+
+// fill in the frame, if this decoder has a good one
+static char decode_done(struct ir_decoder *d, const struct ir_template *tp,
+                struct ir_frame *f)
+{
+    byte proto, toggle;
+    int32_t code;
+
+    proto = pgm_read_byte(&tp->proto);
+
+    if ((d->state & ST_MASK) == ST_REPEATED) {
+        f->proto = proto;
+        f->repeat = 1;
+        f->nbits = 0;
+        f->addr = f->cmd = 0;
+        f->code = 0;
+        return 1;
+    }
+
+    if ((d->state & ST_MASK) != ST_DATA)
+        return 0;
+
+    // a bi-phase frame's last half bit may be a space, which runs
+    // into the quiet line after it.
+    if (d->state & ST_HALF) {
+        if (!(d->state & ST_HALF_MARK))
+            return 0;
+        half_bit(d, pgm_read_byte(&tp->flags), 0);
+    }
+
+    if (d->nbits < pgm_read_byte(&tp->minbits) ||
+            d->nbits > pgm_read_byte(&tp->maxbits))
+        return 0;
+
+    code = d->accum;
+    f->proto = proto;
+    f->repeat = 0;
+    f->nbits = d->nbits;
+
+    switch (proto) {
+    case IRP_SIRC:      // a 7 bit command, then the address
+        f->cmd = code >> (d->nbits - 7);
+        f->addr = code & ((1 << (d->nbits - 7)) - 1);
+        break;
+
+    case IRP_KASEIKYO:  // a maker's id, then 32 bits like nec's
+        f->addr = d->hi;
+        f->cmd = code;
+        break;
+
+    case IRP_RC5:       // start, field, toggle, 5 address, 6 command
+    case IRP_RC6:       // start, 3 mode, toggle, 8 address, 8 command
+        if (proto == IRP_RC5) {
+            code &= 0x1fff;             // the start bit is always 1
+            toggle = (code >> 11) & 1;
+            code &= ~0x800L;
+            f->addr = (code >> 6) & 0x1f;
+            f->cmd = (code & 0x3f) | ((~code >> 6) & 0x40);
+        } else {
+            toggle = (code >> 16) & 1;
+            code &= ~0x10000L;
+            f->addr = (code >> 8) & 0xff;
+            f->cmd = code & 0xff;
+        }
+        // the toggle changes with each press
+        f->repeat = (code == rc_last_code && toggle == rc_last_toggle);
+        rc_last_code = code;
+        rc_last_toggle = toggle;
+        break;
+
+    default:            // address, and command, with their checks
+        f->addr = code >> 16;
+        f->cmd = code;
+        break;
+    }
+    f->code = code;
+    return 1;
+}
+
+/*
+ * the line has gone quiet, so any frame is complete.  returns true
+ * if one was decoded, and resets all the decoders for the next.
+ */
+char ir_decode_end(struct ir_frame *f)
+{
+    byte i;
+    char found = 0;
+
+    for (i = 0; i < NTEMPLATES; i++) {
+        if (!found)
+            found = decode_done(&ir_decoders[i], &ir_templates[i], f);
+        ir_decoders[i].state = ST_IDLE;
+    }
+    return found;
+}
+
+// vile:noti:sw=4
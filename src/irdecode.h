@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2013 Paul Fox, pgf@foxharp.boston.ma.us
+ *
+ * Licensed under GPL version 2, see accompanying LICENSE file
+ * for details.
+ */
+
+/*
+ * the IR protocol decoders.  ir.c hands over the length of every
+ * mark (carrier on) and space, and says when the line has gone
+ * quiet.  see irdecode.c.
+ */
+enum {
+    IRP_NEC = 1,
+    IRP_SAMSUNG,
+    IRP_SIRC,
+    IRP_KASEIKYO,
+    IRP_RC5,
+    IRP_RC6,
+    IRP_OTHER,          // some other pulse distance or width code
+    IRP_COUNT
+};
+
+struct ir_frame {
+    byte proto;
+    byte repeat;        // the button is being held
+    byte nbits;
+    word addr;
+    word cmd;
+    int32_t code;       // what the code table, and learning, go by
+};
+
+#define IR_DECODE_DONE  0       // from ir_decode_edge():  a frame is complete
+#define IR_DECODE_WAIT  0xffff  // ...no telling when it will be
+
+word ir_decode_edge(byte mark, word len);
+char ir_decode_end(struct ir_frame *f);
+
+// vile:noti:sw=4
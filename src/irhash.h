@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2013 Paul Fox, pgf@foxharp.boston.ma.us
+ *
+ * Licensed under GPL version 2, see accompanying LICENSE file
+ * for details.
+ */
+
+/*
+ * the hash for the IR code table, shared by the firmware (ir.c) and
+ * by host/irtable.c, which builds the table from the lircd.conf
+ * files in remotes/.
+ *
+ * it's a "hash and displace" table.  the low bits of the hash pick
+ * a bucket, whose byte of displacement is added to the high bits to
+ * give the slot.  the table builder picks the seed and displacements
+ * so that no two codes land in the same slot, and there are no empty
+ * ones.  a lookup is one hash, and one compare.
+ */
+#include <stdint.h>
+
+static inline uint16_t ir_hash(uint32_t code, uint16_t seed)
+{
+    uint16_t h;
+
+    h = (uint16_t)code ^ seed;
+    h *= 0x9e37u;
+    h ^= (uint16_t)(code >> 16);
+    h *= 0x9e37u;
+    return h ^ (h >> 7);
+}
+
+#define ir_hash_bucket(h, nbuckets)  ((h) & ((nbuckets) - 1))
+
+static inline uint8_t ir_hash_slot(uint16_t h, uint8_t disp, uint8_t size)
+{
+    h += (uint16_t)disp << 8;
+    return ((uint32_t)h * size) >> 16;
+}
+
+// vile:noti:sw=4
@@ -4,12 +4,7 @@
  * Licensed under GPL version 2, see accompanying LICENSE file
  * for details.
  */
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <avr/pgmspace.h>
-#include <avr/sleep.h>
-#include <avr/wdt.h>
-#include <avr/power.h>
+#include "hal.h"
 
 #include "suart.h"
 #include "common.h"
@@ -27,6 +22,179 @@ void __do_copy_data(void) { }
 
 byte saved_mcusr;
 
+volatile byte pending_events;
+
+/*
+ * the main loop's tasks, and the events that wake each of them.
+ * when any event is pending, every task interested in it runs
+ * once, in table order.  expired timers' functions run first.
+ * blind_process() consumes the output of the others, so it runs
+ * last, and on any event.
+ */
+struct task {
+    byte events;
+    void (*func)(void);
+};
+
+static const struct task tasks[] PROGMEM = {
+#ifndef NO_MONITOR
+    { EV_SERIAL,            monitor },
+#endif
+    { EV_TIMER,             sw_timer_process },
+    { EV_IR,                ir_process },
+    { EV_BUTTON,            button_process },
+    { EV_ANY,               blind_process },
+};
+#define NTASKS (sizeof(tasks) / sizeof(tasks[0]))
+
+/*
+ * the main loop sleeps whenever nothing is pending.  these
+ * are recalculated once per second, for the monitor.
+ */
+word wakeups_per_sec;
+byte busy_percent;
+
+static word wakeups;
+static long idle_usec;
+static struct sw_timer stats_timer;
+
+static void loop_stats(void)
+{
+    long idle = idle_usec / 10000;  // percent of the second
+
+    // the sleeps, measured a little long, can add up to more
+    // than the second
+    wakeups_per_sec = wakeups;
+    busy_percent = (idle >= 100) ? 0 : 100 - idle;
+    wakeups = 0;
+    idle_usec = 0;
+}
+
+#ifdef LOOP_PROFILE
+/*
+ * main loop profiling.  we keep the worst and average run time
+ * of each task, and a histogram of the time between successive
+ * passes of the loop, bucketed by powers of two.  times are in
+ * microseconds (8 cpu cycles), from get_usec(), or from the
+ * millisecond timer for intervals too long for that to handle.
+ */
+struct prof_time {
+    long ms;
+    word us;
+};
+
+static struct task_prof {
+    long max;
+    long total;
+    word count;
+} task_prof[NTASKS];
+
+#define LOOP_HIST_SIZE 24   // the last bucket holds 8 seconds and up
+static word loop_hist[LOOP_HIST_SIZE];
+static struct prof_time loop_last;
+
+static void prof_now(struct prof_time *p)
+{
+    p->ms = get_ms_timer();
+    p->us = get_usec();
+}
+
+static long prof_since(struct prof_time *p)
+{
+    long ms;
+
+    ms = get_ms_timer() - p->ms;
+    if (ms > 60)
+        return ms * 1000;
+
+    return (word)(get_usec() - p->us);
+}
+
+static void prof_task(byte i, long usecs)
+{
+    struct task_prof *tp = &task_prof[i];
+
+    if (usecs > tp->max)
+        tp->max = usecs;
+    tp->total += usecs;
+    if (++tp->count == 0) {     // don't let the average go bad
+        tp->total = 0;
+        tp->count = 0;
+    }
+}
+
+static void prof_loop(void)
+{
+    long usecs;
+    byte b;
+
+    usecs = prof_since(&loop_last);
+    prof_now(&loop_last);
+
+    for (b = 0; usecs > 1 && b < LOOP_HIST_SIZE - 1; b++)
+        usecs >>= 1;
+
+    if (loop_hist[b] != 0xffff)
+        loop_hist[b]++;
+}
+
+/* print, and then reset, the profiling data */
+void loop_profile_show(void)
+{
+    byte i;
+    struct task_prof *tp;
+
+    for (i = 0; i < NTASKS; i++) {
+        tp = &task_prof[i];
+        p_hex(i);
+        putstr("fn = 0x");
+        puthex16((word)(long)pgm_read_ptr(&tasks[i].func));
+        putstr("  max = 0x"); puthex32(tp->max);
+        putstr("  mean = 0x"); puthex32(tp->count ? tp->total / tp->count : 0);
+        putstr("  n = "); putdec16(tp->count);
+        crnl();
+        tp->max = tp->total = tp->count = 0;
+    }
+
+    putstr("loop period histogram (usec >= 2^n)\n");
+    for (i = 0; i < LOOP_HIST_SIZE; i++) {
+        if (loop_hist[i]) {
+            putdec16(i);
+            putch('\t');
+            putdec16(loop_hist[i]);
+            crnl();
+            loop_hist[i] = 0;
+        }
+    }
+}
+#endif
+
+static void run_tasks(byte events)
+{
+    const struct task *t;
+    void (*func)(void);
+#ifdef LOOP_PROFILE
+    struct prof_time start;
+
+    prof_loop();
+#endif
+
+    for (t = tasks; t < &tasks[NTASKS]; t++) {
+        if (pgm_read_byte(&t->events) & events) {
+            func = (void (*)(void))pgm_read_ptr(&t->func);
+            hal_task_enter(func);
+#ifdef LOOP_PROFILE
+            prof_now(&start);
+            func();
+            prof_task(t - tasks, prof_since(&start));
+#else
+            func();
+#endif
+            hal_task_exit(func);
+        }
+    }
+}
+
 void cpu_setup(void)
 {
 
@@ -59,30 +227,50 @@ int main()
 
     sei();
 
+    // nothing should be dropped from the startup messages
+    stx_interactive = 1;
+
     putstr("\n" BANNER);
 
     blind_read_config();
 
     if (read_button()) do_debug_out();   // no return
 
+    stx_interactive = 0;
+
     wdt_enable(WDTO_4S);
 
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sw_timer_start(&stats_timer, loop_stats, 1000, 1000);
+
     /* this loop runs forever.  the routines called here
      * must not block -- they act via state machines that
      * react to interrupt events (i.e., input from the user
-     * or senors) and timer expirations.
+     * or senors) and timer expirations.  when there's nothing
+     * to react to, we sleep until the next interrupt.
      */
     while (1) {
+        byte events;
+        word slept;
+
         wdt_reset();
-#ifndef NO_MONITOR
-        monitor();
-#endif
-        led_handle();
-        tone_handle();
-        ir_process();
-        button_process();
 
-        blind_process();
+        cli();
+        events = pending_events;
+        pending_events = 0;
+        if (!events) {
+            slept = get_usec();
+            sleep_enable();
+            sei();          // takes effect after the next instruction...
+            sleep_cpu();    // ...so no wakeup can be missed here
+            sleep_disable();
+            idle_usec += (word)(get_usec() - slept);
+            wakeups++;
+            continue;
+        }
+        sei();
+
+        run_tasks(events);
     }
 
 }
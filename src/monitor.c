@@ -9,17 +9,14 @@
  */
 
 #include <ctype.h>
-#include <avr/io.h>
-#include <avr/wdt.h>
-#include <avr/power.h>
-#include <avr/interrupt.h>
-#include <avr/pgmspace.h>
+#include "hal.h"
 #include "timer.h"
 #include "common.h"
 #include "suart.h"
 #include "ir.h"
 #include "blind.h"
 #include "util.h"
+#include "eewrite.h"
 
 #define ctrl(c) (c ^ 0x40)
 #define DEL 0x7f
@@ -27,6 +24,9 @@
 
 
 #ifndef NO_MONITOR
+
+#define QUICKFOX "The Quick Brown Fox Jumps Over The Lazy Dog\n"
+
 #ifndef MINIMAL_MONITOR
 
 static unsigned char line[16];
@@ -110,6 +110,15 @@ static int gethex(void)
     return n;
 }
 
+// is there another numeric argument?  gethex() says 0 if not.
+static char hexarg(void)
+{
+    while (isspace(line[l])) {
+        l++;
+    }
+    return isxdigit(line[l]) != 0;
+}
+
 static void prompt(void)
 {
     l = 0;
@@ -130,6 +139,9 @@ void monitor(void)
     cmd = line[l++];
     n = gethex();       // fetch a numeric argument.  n will be 0 if none.
 
+    // replies to commands shouldn't be dropped if the tx buffer fills
+    stx_interactive = 1;
+
     switch (cmd) {
     case '\0':
         break;
@@ -217,6 +229,59 @@ void monitor(void)
         ir_show_code();
         break;
 
+    case 'k': // cmd: show learned IR codes
+        // 'k 1' learns a remote's top, middle, bottom, stop, and
+        // alt buttons, in that order.  'k 2' forgets them all.
+        ir_learn(n);
+        break;
+
+#ifdef IR_CAPTURE
+    case 'y': // cmd: stream raw IR pulses, as lirc "mode2" text
+        // 'y 1' starts, 'y 0' stops
+        ir_capture(n);
+        break;
+#endif
+
+    case 'c': // cmd: show learned coast distances, and arrival errors
+        // 'c 1' forgets the learned distances
+        blind_show_coast(n);
+        break;
+
+    case 'h': // cmd: limit switch drift measurement
+        // 'h 1' starts:  "bottom" then goes to the limit, and each
+        // visit's error is reported, with the total.  'h 2' stops.
+        // shows the total, and the worst visit.  also shows where the
+        // limit switch reset found us, and how far off the count was.
+        blind_drift(n);
+        break;
+
+    case 'g': // cmd: show rotation pulses rejected as glitches
+        // 'g 1' also resets the counts
+        blind_show_rejects(n);
+        break;
+
+    case 'a': // cmd: show slow approach distances, in pulses
+        // 'a up down' sets them.  zero is full speed to the stop.
+        if (line[1] == '\0') {
+            blind_slow_approach(0, 0, 0);
+            break;
+        }
+        l = 1;
+        if (hexarg()) {
+            i = gethex();
+            if (hexarg() && blind_slow_approach(1, i, gethex()))
+                break;
+        }
+        putch('?');     // both are needed, and they must be in range
+        crnl();
+        break;
+
+#ifdef MOVE_TRACE
+    case 'r': // cmd: show the rotation pulse trace of the latest move
+        blind_show_trace();
+        break;
+#endif
+
     case 'l': // cmd: show limit switch
         p_hex(blind_at_limit());
         crnl();
@@ -245,7 +310,6 @@ void monitor(void)
     case 'T':
         set_ms_timer(0x7fffffffL - ((long)n * 1000L));
         print_tstamp();
-        motor_state_timer = get_ms_timer();
         break;
 
     case 'P': // cmd: p_hex/p_dec/p_str testing
@@ -266,7 +330,6 @@ void monitor(void)
         break;
 
     case 'q': // cmd: quick brown fox
-#define QUICKFOX "The Quick Brown Fox Jumps Over The Lazy Dog\n"
         for (i = 0; i < 20; i++)
             putstr(QUICKFOX);
         break;
@@ -281,7 +344,8 @@ void monitor(void)
     case 'e': // cmd: watchdog reboot
         // reboot us, using the watchdog
         wdt_enable(WDTO_250MS);
-        for (;;);
+        for (;;)
+            hal_spin();
         break;
 
 #if LATER
@@ -294,16 +358,49 @@ void monitor(void)
         break;
 #endif
 
-    case 'V':
+    case 'V': // cmd: show config, and whether it's being written
         print_tstamp();
         dump_config();
+        p_dec(ee_busy());
+        crnl();
+        break;
+
+    case 'W': // cmd: main loop wakeups per second, and busy percentage
+        p_dec(wakeups_per_sec);
+        p_dec(busy_percent);
+        crnl();
+        break;
+
+#ifdef LOOP_PROFILE
+    case 'p': // cmd: show and reset main loop profile
+        loop_profile_show();
+        break;
+#endif
+
+#ifdef ISR_PROFILE
+    case 'N': // cmd: show and reset interrupt handler profile
+        isr_profile_show();
+        break;
+#endif
+
+    case 'S': // cmd: serial output stats, and optional overflow policy
+        // 'S' shows and resets the counters, 'S 1/2/3' also sets
+        // the policy to block, drop debug output, or drop all
+        if (n > STX_DROP) {
+            putch('?');
+            crnl();
+            break;
+        }
+        if (n)
+            stx_policy = n;
+        suart_show_stats();
         break;
 
     case 'w': // cmd:  write addr data
         // 'w addr data'
         addr = n;
         n = gethex();
-        *(unsigned char *) addr = n;
+        *sram_ptr(addr) = n;
         break;
 
     case 'x':                   //  cmd: read data byte
@@ -325,9 +422,9 @@ void monitor(void)
         puthex16(addr);
         putstr(": ");
         if (addr_is_data)
-            puthex(*(unsigned char *)addr);
+            puthex(*sram_ptr(addr));
         else
-            puthex(pgm_read_byte(addr));
+            puthex(pgm_read_byte(flash_ptr(addr)));
         putch('\n');
         break;
 
@@ -337,6 +434,8 @@ void monitor(void)
     }
 
     prompt();
+
+    stx_interactive = 0;
 }
 
 
@@ -386,7 +485,8 @@ void monitor(void)
 
     case 'e':
         wdt_enable(WDTO_250MS);
-        for (;;);
+        for (;;)
+            hal_spin();
         break;
 
     }
@@ -9,13 +9,11 @@
  *
  */
 
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <avr/pgmspace.h>
-#include <avr/wdt.h>
+#include "hal.h"
 #include "common.h"
 #include "timer.h"
 #include "suart.h"
+#include "util.h"
 
 /*
  * software-driven uart for uart-less AVR chips.
@@ -35,7 +33,9 @@
 #define RX_INVERT 0
 
 // reception can be disabled if it's not needed
+#ifndef NO_RECEIVE
 #define NO_RECEIVE 0
+#endif
 
 // timer running at 1Mhz
 #define BIT_TIME    (unsigned int)((1000000 + BAUD/2) / BAUD)
@@ -43,6 +43,27 @@
 volatile unsigned char stx_bits;
 volatile unsigned char stx_data;
 
+/*
+ * transmit buffering.  putch() queues characters in a ring, and
+ * the bit-timer interrupt pulls the next one off whenever it has
+ * finished sending the previous one.  the caller only waits if the
+ * ring is full, and then only if the overflow policy allows it.
+ */
+#define STX_BUFSIZE 64      // must be a power of 2
+static volatile unsigned char stx_buf[STX_BUFSIZE];
+volatile unsigned char stx_head;    // written only by putch()
+volatile unsigned char stx_tail;    // written only by the ISR
+
+unsigned char stx_policy;
+unsigned char stx_interactive;
+static unsigned char stx_midline;   // the last character wasn't a newline
+static unsigned char stx_skip;      // dropping the rest of this line
+#define STX_SKIP_ALL    1           // ...all of it
+#define STX_SKIP_REST   2           // ...but end what was sent
+static unsigned char stx_owed;      // a cut-off line's newline is owed
+unsigned int stx_dropped;
+unsigned char stx_peak;
+
 #if ! NO_RECEIVE
 volatile unsigned char srx_done;
 volatile unsigned char srx_data;
@@ -79,6 +100,8 @@ void suart_init(void)
     t1write10(OCR1A, t1read10_TCNT1() + 25);
 
     stx_bits = 0;               // nothing to send right now
+    stx_head = stx_tail = 0;
+    stx_policy = STX_DROP_DEBUG;
     STIMSK |= bit(OCIE1A);      // enable tx
 
 
@@ -114,8 +137,10 @@ void suart_init(void)
 // the macro getch_avail() as a non-blocking test if required.
 unsigned char getch(void)       // get byte
 {
-    while (!srx_done)           // wait until byte received
+    while (!srx_done) {         // wait until byte received
         wdt_reset();
+        hal_spin();
+    }
     srx_done = 0;
     return srx_data;
 }
@@ -137,6 +162,7 @@ ISR(INT0_vect)              // rx start
 #endif
 {
     int w10tmp;
+    ISR_PROF_ENTER();
 
     // schedule our next interrupt 1.5 bits from now
 #if RX_USE_INPUT_CAPTURE_INT
@@ -155,12 +181,15 @@ ISR(INT0_vect)              // rx start
         STIMSK |= bit(OCIE1B);  // wait for first bit
     }
 
+    ISR_PROF_EXIT(ISRP_INT0);
+
 }
 
 
 ISR(TIMER1_COMPB_vect)   // time to sample the value of an RX bit
 {
     unsigned char in = SRXPIN;  // grab current rx level
+    ISR_PROF_ENTER();
 
     if (srx_mask) {
         // schedule interrupt for next bit sample
@@ -176,6 +205,7 @@ ISR(TIMER1_COMPB_vect)   // time to sample the value of an RX bit
         // all done
         srx_done = 1;               // mark rx data valid
         srx_data = srx_tmp;         // store rx data
+        post_event(EV_SERIAL);
 
         // disable the bit sampling interrupt
         STIMSK &= ~bit(OCIE1B);     // disable rx bit timer
@@ -189,24 +219,111 @@ ISR(TIMER1_COMPB_vect)   // time to sample the value of an RX bit
         GIMSK |= bit(INT0);
 #endif
     }
+
+    ISR_PROF_EXIT(ISRP_T1_COMPB);
 }
 #endif
 
 
+// the bit timer interrupt is off while there's nothing to send,
+// so it doesn't wake us.  start it again, as suart_init() does.
+static void stx_start(void)
+{
+    int w10tmp;
+    char sreg;
+
+    sreg = SREG;
+    cli();
+    if (!(STIMSK & bit(OCIE1A))) {
+        t1write10(OCR1A, t1read10_TCNT1() + 25);
+        STIFR = bit(OCF1A);
+        STIMSK |= bit(OCIE1A);
+    }
+    SREG = sreg;
+}
+
+// queue a character, waiting for room if allowed.  returns 0 if it
+// was dropped.
+static unsigned char stx_put(char val, unsigned char drop)
+{
+    unsigned char head, next, fill;
+
+    head = stx_head;
+    next = (head + 1) & (STX_BUFSIZE - 1);
+
+    if (next == stx_tail) {
+        // the ring is full.  waiting with interrupts off would
+        // wait forever, so always drop in that case.
+        if (drop || !(SREG & bit(SREG_I)))
+            return 0;
+
+        while (next == stx_tail)    // loop until the ISR frees a slot
+            hal_spin();
+    }
+
+    stx_buf[head] = val;
+    stx_head = next;
+    stx_start();
+
+    fill = (next - stx_tail) & (STX_BUFSIZE - 1);
+    if (fill > stx_peak)
+        stx_peak = fill;
+    return 1;
+}
+
+/*
+ * output that may be dropped goes a line at a time, so what's
+ * seen isn't cut off mid-number.  a line is skipped if there
+ * isn't STX_LINE_ROOM to start it.  a longer one that overflows
+ * anyway loses its end.  its newline is still sent, then or
+ * before the next line that is, so that one starts clean.
+ */
 void putch(char val)        // send a character
 {
-    if (val == '\n')
-        putch('\r');
-
-    while (stx_bits)        // loop until previous character is sent
-        /* loop */ ;
-
-    // we need to send 10 bits, but can only store 8.  the
-    // start bit is 0, the stop bit is 1.  we special-case the
-    // start bit when transmitting, but can get the stop bit
-    // for "free" by inverting the data.
-    stx_data = ~val;        // invert data for Stop bit generation
-    stx_bits = 10;          // 1 start bit + 8 + 1 stop bit
+    unsigned char drop;
+
+    drop = stx_policy == STX_DROP ||
+            (stx_policy == STX_DROP_DEBUG && !stx_interactive);
+
+    if (!stx_midline) {
+        if (drop && stx_room() < STX_LINE_ROOM + 2 * stx_owed) {
+            stx_skip = STX_SKIP_ALL;
+        } else {
+            stx_skip = 0;
+            if (stx_owed && stx_put('\r', drop) && stx_put('\n', drop))
+                stx_owed = 0;
+        }
+    }
+    stx_midline = (val != '\n');
+
+    if (drop && (stx_skip == STX_SKIP_ALL || (stx_skip && val != '\n'))) {
+        stx_dropped++;
+        return;
+    }
+
+    if ((val == '\n' && !stx_put('\r', drop)) || !stx_put(val, drop)) {
+        stx_dropped++;
+        if (stx_midline)
+            stx_skip = STX_SKIP_REST;
+        else
+            stx_owed = 1;
+    }
+}
+
+// how many more characters putch() will take without waiting
+unsigned char stx_room(void)
+{
+    return (stx_tail - stx_head - 1) & (STX_BUFSIZE - 1);
+}
+
+void suart_show_stats(void)
+{
+    p_dec(stx_policy);
+    p_dec(stx_peak);
+    p_dec(stx_dropped);
+    crnl();
+    stx_peak = 0;
+    stx_dropped = 0;
 }
 
 
@@ -214,13 +331,34 @@ ISR(TIMER1_COMPA_vect, ISR_NOBLOCK)  // time to transmit a bit
 {
     unsigned char dout;
     unsigned char remaining;
-
+    ISR_PROF_ENTER();
 
     // schedule another interrupt one bit-time from now
     t1add10(OCR1A, BIT_TIME);
 
     remaining = stx_bits;
 
+    if (!remaining) {
+        unsigned char tail = stx_tail;
+
+        if (tail != stx_head) {
+            // we need to send 10 bits, but can only store 8.  the
+            // start bit is 0, the stop bit is 1.  we special-case the
+            // start bit when transmitting, but can get the stop bit
+            // for "free" by inverting the data.
+            stx_data = ~stx_buf[tail];  // invert data for Stop bit generation
+            stx_tail = (tail + 1) & (STX_BUFSIZE - 1);
+            remaining = 10;             // 1 start bit + 8 + 1 stop bit
+        } else {
+            // the stop bit is out, and the line idles high.  stop
+            // until stx_put() has more.  it may be at it right now.
+            cli();
+            if (stx_tail == stx_head)
+                STIMSK &= ~bit(OCIE1A);
+            sei();
+        }
+    }
+
     if (remaining) {
         dout = SET_TX_LOW_NEXT;
         if (remaining != 10) {          // all except for the start bit
@@ -231,6 +369,8 @@ ISR(TIMER1_COMPA_vect, ISR_NOBLOCK)  // time to transmit a bit
         TCCR1A = dout;
         stx_bits = remaining - 1;       // count down
     }
+
+    ISR_PROF_EXIT(ISRP_T1_COMPA);
 }
 
 // vile:noti:sw=4
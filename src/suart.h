@@ -73,10 +73,28 @@ unsigned char getch(void);
 #define getch_avail() (srx_done)              // true if byte received
 #else
 #define getch_avail() (0)                     // never true
+#define getch() (0)
 #endif
 
-extern volatile unsigned char stx_count;
-#define stx_active() (stx_count)
+extern volatile unsigned char stx_bits;
+extern volatile unsigned char stx_head, stx_tail;
+#define stx_active() (stx_bits || stx_head != stx_tail)
+
+/* what putch() does when the transmit ring is full */
+#define STX_BLOCK       1   // wait for room
+#define STX_DROP_DEBUG  2   // wait only for interactive output, else drop
+#define STX_DROP        3   // always drop the new character
+extern unsigned char stx_policy;
+// the room a line of droppable output needs, to be started at all.
+// most debug lines fit in this.  longer ones may lose their ends.
+#define STX_LINE_ROOM   40
+// set while producing output that was explicitly asked for (e.g.,
+// a reply to a monitor command), which STX_DROP_DEBUG won't drop.
+extern unsigned char stx_interactive;
+extern unsigned int stx_dropped;
+extern unsigned char stx_peak;
+unsigned char stx_room(void);
+void suart_show_stats(void);
 
 void suart_init(void);
 
@@ -6,9 +6,7 @@
  * for details.
  */
 
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <avr/pgmspace.h>
+#include "hal.h"
 
 #include "timer.h"
 #include "util.h"
@@ -16,10 +14,19 @@
 #include "limits.h"
 #include "common.h"
 
-#ifndef NO_MSTIMER
-
 long milliseconds;
 
+/*
+ * pending software timers, in deadline order.  the millisecond
+ * interrupt only compares against the earliest deadline, which
+ * we keep a copy of, so it never has to walk the list.
+ */
+static struct sw_timer *sw_timers;
+static volatile long sw_timer_due;
+static volatile char sw_timer_armed;
+
+static struct sw_timer second_timer;
+
 #define PRINT_TSTAMPS 1
 #if PRINT_TSTAMPS
 void print_tstamp(void)
@@ -38,6 +45,12 @@ void print_tstamp(void)
 void print_tstamp(void) {}
 #endif
 
+static void once_per_second(void)
+{
+    led_flash();
+    blind_report();
+}
+
 void init_timer(void)
 {
     int w10tmp;
@@ -63,24 +76,33 @@ void init_timer(void)
     t1write10(OCR1D, 1000);
 
     TIMSK |= bit(OCIE1D);
+
+    sw_timer_start(&second_timer, once_per_second, 1000, 1000);
 }
 
+/*
+ * timer1 can't be slowed down (suart.c needs its microsecond
+ * resolution, and it's only 10 bits wide), so this still
+ * interrupts every millisecond.  but it only wakes the main loop
+ * when a software timer is due.
+ */
 ISR(TIMER1_COMPD_vect)
 {
+    ISR_PROF_ENTER();
+
     // reprime the comparator for 1ms in the future
     t1add10(OCR1D, 1000);
 
     milliseconds++;
 
+    if (sw_timer_armed && milliseconds - sw_timer_due >= 0)
+        post_event(EV_TIMER);
+
     sei();
 
     tone_cycle();
 
-    // approximately 1/second (much cheaper, codewise, than "% 1000")
-    if ((milliseconds & 1023) == 0) {
-        led_flash();
-        blind_report();
-    }
+    ISR_PROF_EXIT(ISRP_T1_COMPD);
 }
 
 long get_ms_timer(void)
@@ -100,16 +122,101 @@ long get_ms_timer(void)
 
 void set_ms_timer(long ms)
 {
+    struct sw_timer *t;
+    long delta;
     char sreg;
 
     sreg = SREG;
     cli();
 
+    // move any pending deadlines along with the clock
+    delta = ms - milliseconds;
+    for (t = sw_timers; t; t = t->next)
+        t->expires += delta;
+    sw_timer_due += delta;
+
     milliseconds = ms;
 
     SREG = sreg;
 }
 
+/*
+ * a microsecond clock, built from the millisecond count plus
+ * timer1's distance from the most recent millisecond tick.  it
+ * wraps every 65ms, so it's only good for timing short intervals.
+ */
+unsigned int get_usec(void)
+{
+    word ms, t1, last;
+    char sreg;
+
+    sreg = SREG;
+    cli();
+
+    ms = milliseconds;
+
+    // OCR1D holds the time of the next tick.  if that tick
+    // has already happened, but its interrupt hasn't yet been
+    // serviced, then it's the most recent one.  check for that
+    // before reading the counter, so a tick that lands between
+    // the two reads just makes us a little late.
+    last = OCR1D;
+    last |= TC1H << 8;
+    if (TIFR & bit(OCF1D))
+        ms++;
+    else
+        last -= 1000;
+
+    t1 = t1read10_TCNT1();
+
+    SREG = sreg;
+
+    return ms * 1000 + ((t1 - last) & 0x3ff);
+}
+
+#ifdef ISR_PROFILE
+struct isr_prof isr_prof[ISRP_COUNT];
+unsigned char isr_depth, isr_max_depth;
+
+static const char * const isr_names[ISRP_COUNT] PROGMEM = {
+    "INT0", "INT1", "PCINT", "T0_OVF", "T0_CAPT",
+    "T1_COMPA", "T1_COMPB", "T1_COMPD", "EE_RDY", "ANA_COMP",
+};
+
+/*
+ * print, and then reset, the interrupt profile.  to judge a baud
+ * rate, compare the worst case of everything that can delay
+ * T1_COMPA or T1_COMPB against the bit time (104us at 9600,
+ * 52us at 19200, 26us at 38400).
+ */
+void isr_profile_show(void)
+{
+    unsigned char i;
+    struct isr_prof p;
+
+    for (i = 0; i < ISRP_COUNT; i++) {
+        cli();
+        p = isr_prof[i];
+        isr_prof[i].count = 0;
+        isr_prof[i].max = 0;
+        isr_prof[i].total = 0;
+        sei();
+
+        putstr((const char *)pgm_read_ptr(&isr_names[i]));
+        putstr(":\tn = ");
+        putdec16(p.count);
+        putstr("  max = ");
+        putdec16(p.max);
+        putstr("  total = 0x");
+        puthex32(p.total);
+        crnl();
+    }
+    p_dec(isr_max_depth);
+    crnl();
+    isr_max_depth = 0;
+}
+#endif
+
 unsigned char check_timer(long t0, long delta)
 {
     // the timer will eventually wrap from positive (0x7fffffff)
@@ -122,6 +229,112 @@ unsigned char check_timer(long t0, long delta)
     return (get_ms_timer() - t0 > delta);
 }
 
+/*
+ * software timers
+ */
+
+// recopy the earliest deadline, for the interrupt handler
+static void sw_timer_update(void)
+{
+    char sreg;
+
+    sreg = SREG;
+    cli();
+
+    if (sw_timers) {
+        sw_timer_due = sw_timers->expires;
+        sw_timer_armed = 1;
+    } else {
+        sw_timer_armed = 0;
+    }
+
+    SREG = sreg;
+}
+
+// remove a timer from the list, returning true if it was there
+static char sw_timer_unlink(struct sw_timer *t)
+{
+    struct sw_timer **tp;
+
+    for (tp = &sw_timers; *tp; tp = &(*tp)->next) {
+        if (*tp == t) {
+            *tp = t->next;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// add a timer to the list, behind any others with the same deadline
+static void sw_timer_insert(struct sw_timer *t)
+{
+    struct sw_timer **tp;
+
+    for (tp = &sw_timers; *tp; tp = &(*tp)->next) {
+        if ((*tp)->expires - t->expires > 0)
+            break;
+    }
+    t->next = *tp;
+    *tp = t;
+}
+
+/*
+ * arm (or rearm) a timer to call func after "delay" milliseconds,
+ * and then every "period" milliseconds after that, if period is
+ * non-zero.  func may be null, in which case the timer's only
+ * effect is to wake the main loop, and to stop being pending.
+ */
+void sw_timer_start(struct sw_timer *t, void (*func)(void),
+                unsigned int delay, unsigned int period)
+{
+    sw_timer_unlink(t);
+
+    t->func = func;
+    t->period = period;
+    t->expires = get_ms_timer() + delay;
+
+    sw_timer_insert(t);
+    sw_timer_update();
+}
+
+void sw_timer_stop(struct sw_timer *t)
+{
+    if (sw_timer_unlink(t))
+        sw_timer_update();
+}
+
+unsigned char sw_timer_pending(struct sw_timer *t)
+{
+    struct sw_timer *p;
+
+    for (p = sw_timers; p; p = p->next) {
+        if (p == t)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * run the functions of all expired timers.  called from the
+ * main loop, whenever the interrupt handler says one is due.
+ */
+void sw_timer_process(void)
+{
+    struct sw_timer *t;
+
+    while ((t = sw_timers) && get_ms_timer() - t->expires >= 0) {
+        sw_timers = t->next;
+        if (t->period) {
+            t->expires += t->period;
+            sw_timer_insert(t);
+        }
+        sw_timer_update();
+
+        if (t->func)
+            t->func();
+    }
+}
+
 void short_delay(unsigned int n)
 {
     unsigned int t;
@@ -131,6 +344,4 @@ void short_delay(unsigned int n)
     }
 }
 
-#endif
-
 // vile:noti:sw=4
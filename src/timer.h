@@ -11,8 +11,28 @@ void init_timer(void);
 long get_ms_timer(void);
 void set_ms_timer(long ms);
 unsigned char check_timer(long time0, long duration);
+unsigned int get_usec(void);
 void print_tstamp(void);
 
+/*
+ * software timers.  the caller owns each timer's storage.  pending
+ * timers are kept in deadline order, and expired timers' functions
+ * are called from the main loop, by sw_timer_process() -- never
+ * from interrupt context.
+ */
+struct sw_timer {
+    struct sw_timer *next;
+    long expires;
+    unsigned int period;        // zero for one-shot timers
+    void (*func)(void);
+};
+
+void sw_timer_start(struct sw_timer *t, void (*func)(void),
+                unsigned int delay, unsigned int period);
+void sw_timer_stop(struct sw_timer *t);
+unsigned char sw_timer_pending(struct sw_timer *t);
+void sw_timer_process(void);
+
 #if F_CPU == 8000000
 #define usecs_per_100_loops 0x89   // at 8Mhz
 #endif
@@ -22,6 +42,17 @@ void short_delay(unsigned int n);  // try not to call this.  use usec_delay()
 #define usecs_to_loops(u) ((100*(long)(u))/usecs_per_100_loops)
 #define usec_delay(usecs) short_delay(usecs_to_loops(usecs)+1)
 
+#ifdef HOST_BUILD
+/*
+ * the simulated timer1 registers hold all ten bits themselves, and
+ * the simulated TC1H always reads as zero, so plain 8-bit style
+ * reads of them still work.
+ */
+#define t1write10(reg, val) { w10tmp = (val); reg = w10tmp & 0x3ff; }
+#define t1add10(reg, incr)  { reg = (reg + (incr)) & 0x3ff; }
+#define t1read10_TCNT1()    sim_tcnt1()
+#else
+
 #define t1write10(reg, val) {           \
     char sreg = SREG;                   \
     cli();                              \
@@ -75,6 +106,73 @@ static inline int t1read10_ICR1(reg)    \
                                         \
     SREG = sreg;                        \
 }
+#endif
+
 
+#ifdef ISR_PROFILE
+/*
+ * interrupt handler profiling.  each handler counts its entries,
+ * and its longest and total run times, in timer1 ticks (1 usec,
+ * or 8 cpu cycles).  times include any nested handlers.  we also
+ * track the deepest nesting seen.
+ */
+enum {
+    ISRP_INT0,
+    ISRP_INT1,
+    ISRP_PCINT,
+    ISRP_T0_OVF,
+    ISRP_T0_CAPT,
+    ISRP_T1_COMPA,
+    ISRP_T1_COMPB,
+    ISRP_T1_COMPD,
+    ISRP_EE_RDY,
+    ISRP_ANA_COMP,
+    ISRP_COUNT,
+};
+
+struct isr_prof {
+    unsigned int count;
+    unsigned int max;
+    long total;
+};
+extern struct isr_prof isr_prof[ISRP_COUNT];
+extern unsigned char isr_depth, isr_max_depth;
+void isr_profile_show(void);
+
+static inline unsigned int isr_prof_enter(void)
+{
+    char sreg = SREG;
+    cli();
+    if (++isr_depth > isr_max_depth)
+        isr_max_depth = isr_depth;
+    SREG = sreg;
+
+    return t1read10_TCNT1();
+}
+
+static inline void isr_prof_exit(unsigned char n, unsigned int t0)
+{
+    unsigned int t;
+    struct isr_prof *p = &isr_prof[n];
+    char sreg;
+
+    t = (t1read10_TCNT1() - t0) & 0x3ff;
+
+    sreg = SREG;
+    cli();
+    isr_depth--;
+    p->count++;
+    if (t > p->max)
+        p->max = t;
+    p->total += t;
+    SREG = sreg;
+}
+
+#define ISR_PROF_ENTER()  unsigned int isr_prof_t0 = isr_prof_enter()
+#define ISR_PROF_EXIT(n)  isr_prof_exit(n, isr_prof_t0)
+#else
+#define ISR_PROF_ENTER()
+#define ISR_PROF_EXIT(n)
+#endif
 
 // vile:noti:sw=4
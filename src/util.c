@@ -6,10 +6,7 @@
  *
  */
 
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <avr/pgmspace.h>
-#include <avr/wdt.h>
+#include "hal.h"
 #include "suart.h"
 #include "timer.h"
 #include "util.h"
@@ -95,34 +92,32 @@ void putstr(const prog_char * s)
 /*
  * LED
  */
-static long led_time;
+static struct sw_timer led_timer;
 
 void init_led(void)
 {
     DDRLED |= bit(BITLED);  // set to output
 }
 
+/* turn off a timed LED flash */
+static void led_off(void)
+{
+    led1_off();
+}
+
 /* commence a timed flash */
 void led_flash(void)
 {
     led1_on();
-    led_time = get_ms_timer();
+    sw_timer_start(&led_timer, led_off, 100, 0);
     return;
 }
 
-/* turn off a timed LED flash */
-void led_handle(void)
-{
-    if (led1_is_on() && check_timer(led_time, 100))
-        led1_off();
-}
-
 
 /*
  * tones
  */
-static long tone_time;
-static int tone_duration;
+static struct sw_timer tone_timer;
 char tone_on, tonecnt;
 
 void tone_hw_enable(void)
@@ -138,26 +133,21 @@ void tone_hw_disable(void)
     DDRTONE &= ~TONEBITS;
 }
 
+/* silence tone */
+static void tone_stop(void)
+{
+    tone_on = 0;
+    tone_hw_disable();  // set both pins to input when off
+}
+
 void tone_start(char hilo, int duration)
 {
     tone_on = hilo;
-    tone_time = get_ms_timer();
-    tone_duration = duration;
     tone_hw_enable();
+    sw_timer_start(&tone_timer, tone_stop, duration, 0);
     return;
 }
 
-void tone_handle(void)
-{
-    /* silence tone */
-    if (check_timer(tone_time, tone_duration)) {
-        tone_on = 0;
-        tone_time = 0;
-        tone_hw_disable();  // set both pins to input when off
-    }
-
-}
-
 /*
  * delay - wait a bit.  this simply busy-waits, so it shouldn't
  *  be used much, if ever.
@@ -29,10 +29,9 @@ void do_debug_out(void);
 
 #define led1_on()       do { PORTLED |=  bit(BITLED); } while(0)
 #define led1_off()      do { PORTLED &= ~bit(BITLED); } while(0)
-#define led1_flip()     do { PINLED   =  bit(BITLED); } while(0)
+#define led1_flip()     pin_toggle(PINLED, bit(BITLED))
 #define led1_is_on()       ( PINLED   &  bit(BITLED) )
 void init_led(void);
-void led_handle(void);
 void led_flash(void);
 void blinky(void);
 
@@ -43,14 +42,13 @@ void blinky(void);
 # define TONEBITS (bit(PA5)|bit(PA6))  // we drive the speaker from two pins
 # define ONE_TONEBIT bit(PA5)
 
-#define tone_flip()     do { PINTONE =  TONEBITS; } while(0)  // toggle both
+#define tone_flip()     pin_toggle(PINTONE, TONEBITS)  // toggle both
 #define tone_cycle()    do { \
         if (tone_on && (tonecnt++ & tone_on) == 0) tone_flip(); } while(0)
 
 void tone_hw_disable(void);
 void tone_hw_enable(void);
 void init_tone(void);
-void tone_handle(void);
 extern char tone_on, tonecnt;
 void tone_start(char hilo, int duration);
 // this is a little ugly, but a tone is described by both its